@@ -0,0 +1,74 @@
+// Compare the cost of evaluating with the library to spawning the CLI
+//
+// Copyright (C) 2007
+// Center for Perceptual Systems
+// University of Texas at Austin
+
+#include "librpn.h"
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+using namespace jsp;
+
+const char *EXPR = "1 2 + 3 * 4 5 6 sum";
+
+// Mean seconds per call of f
+template<typename F>
+double Time (size_t n, F f)
+{
+    typedef chrono::steady_clock clock;
+    const clock::time_point start = clock::now ();
+    for (size_t i = 0; i < n; ++i)
+        f ();
+    return chrono::duration<double> (clock::now () - start).count () / n;
+}
+
+int main (int argc, char *argv[])
+{
+    try
+    {
+        if (argc != 2)
+            throw runtime_error ("usage: bench_librpn path_to_rpn");
+
+        const string cmd = string ("echo '") + EXPR + "' | " + argv[1] + " 2>/dev/null";
+
+        volatile double sink = 0.0;
+
+        // A new context for each call, like a new process
+        const double fresh = Time (100000, [&] {
+            Context c;
+            sink = c.Evaluate (EXPR).value;
+        });
+        // One context for all calls
+        Context c;
+        const double reused = Time (1000000, [&] {
+            c.Evaluate ("clr");
+            sink = c.Evaluate (EXPR).value;
+        });
+        const double spawn = Time (200, [&] {
+            FILE *fp = popen (cmd.c_str (), "r");
+            if (!fp)
+                throw runtime_error ("Could not run " + cmd);
+            double x;
+            if (fscanf (fp, "%lf", &x) == 1)
+                sink = x;
+            pclose (fp);
+        });
+
+        cout << "expression\t" << EXPR << endl;
+        cout << "new context\t" << fresh * 1e6 << " us/call" << endl;
+        cout << "same context\t" << reused * 1e6 << " us/call" << endl;
+        cout << "spawn cli\t" << spawn * 1e6 << " us/call" << endl;
+        cout << "speedup\t" << spawn / fresh << "x" << endl;
+        return 0;
+    }
+    catch (const exception &e)
+    {
+        cerr << e.what () << endl;
+        return -1;
+    }
+}
@@ -0,0 +1,230 @@
+// Reverse Polish Notation Calculator Library
+//
+// Copyright (C) 2007
+// Center for Perceptual Systems
+// University of Texas at Austin
+
+#include "librpn.h"
+#include <exception>
+#include <stdexcept>
+
+namespace jsp
+{
+
+namespace
+{
+
+bool IsSpace (char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+bool Parse (std::string_view str, double &x)
+{
+    return ParseDouble (str, x);
+}
+
+bool Parse (std::string_view str, uint64_t &x)
+{
+    return ParseInt (str, x);
+}
+
+} // namespace
+
+Context::Context (CalcMode mode) :
+    mode (mode),
+    sink (&null_sink),
+    source (0),
+    tokens (*this),
+    display (&null_sink, &tokens),
+    show_stack (false),
+    display_enabled (true),
+    pos (0)
+{
+    switch (mode)
+    {
+        case BASIC_MODE: calc.reset (new BasicCalc); break;
+        case HP35_MODE: calc.reset (new HP35); break;
+        case SUPER_MODE: calc.reset (new SuperCalc); break;
+        case INT_MODE: calc.reset (new IntCalc); break;
+        default: throw std::runtime_error ("Invalid calculator mode");
+    }
+}
+
+void Context::SetSink (Sink *s)
+{
+    sink = s ? s : &null_sink;
+    display.SetSink (sink);
+}
+
+void Context::SetMemoryLimit (size_t bytes)
+{
+    stack.SetMemoryLimit (bytes);
+    int_stack.SetMemoryLimit (bytes);
+}
+
+void Context::SetSpillDirectory (const std::string &dir)
+{
+    stack.SetSpillDirectory (dir);
+    int_stack.SetSpillDirectory (dir);
+}
+
+Result Context::Evaluate (std::string_view str)
+{
+    text = str;
+    pos = 0;
+    Result r;
+    r.status = EVAL_OK;
+    r.position = 0;
+    std::string token;
+    while (true)
+    {
+        const size_t start = pos;
+        if (!NextToken (token))
+            break;
+        bool ok;
+        try
+        {
+            if (mode == INT_MODE)
+                ok = EvalToken<IntStack,uint64_t> (int_stack, token, r);
+            else
+                ok = EvalToken<Stack,double> (stack, token, r);
+        }
+        catch (const std::exception &e)
+        {
+            r.status = EVAL_ERROR;
+            r.message = e.what ();
+            ok = false;
+        }
+        if (!ok)
+        {
+            // Point at the token itself, not the whitespace before it
+            r.position = start;
+            while (r.position < text.size () && IsSpace (text[r.position]))
+                ++r.position;
+            r.token = token;
+            break;
+        }
+    }
+    r.position = r.status == EVAL_OK ? text.size () : r.position;
+    if (mode == INT_MODE)
+    {
+        r.depth = int_stack.Size ();
+        r.int_value = int_stack.Top ();
+        r.value = static_cast<double> (r.int_value);
+    }
+    else
+    {
+        r.depth = stack.Size ();
+        r.value = stack.Top ();
+        r.int_value = 0;
+    }
+    text = std::string_view ();
+    pos = 0;
+    return r;
+}
+
+// Returns false if evaluation should stop
+template<typename S,typename T>
+bool Context::EvalToken (S &s, const std::string &token, Result &r)
+{
+    T x;
+    if (Parse (token, x))
+    {
+        s.Push (x);
+        display.View ();
+    }
+    else if (token == "quit")
+    {
+        r.status = EVAL_QUIT;
+        return false;
+    }
+    else if (token == "help")
+    {
+        Help ();
+        return true;
+    }
+    else if (calc->IsDisplayOp (token))
+    {
+        if (!display_enabled)
+        {
+            // Run it on a scratch display, so that it still takes its
+            // argument, like the precision, and leaves the stack alone
+            Display scratch (&null_sink, &tokens);
+            calc->Exec (token, s, scratch);
+            return true;
+        }
+        calc->Exec (token, s, display);
+    }
+    else if (calc->Lookup (token))
+    {
+        calc->Exec (token, s, display);
+        // Changing the stack scrolls back to the top
+        display.View ();
+    }
+    else
+    {
+        r.status = EVAL_UNKNOWN_TOKEN;
+        r.message = "Unknown token";
+        return false;
+    }
+    if (show_stack)
+        Show ();
+    return true;
+}
+
+bool Context::NextToken (std::string &token)
+{
+    while (pos < text.size () && IsSpace (text[pos]))
+        ++pos;
+    if (pos == text.size ())
+        return false;
+    const size_t start = pos;
+    while (pos < text.size () && !IsSpace (text[pos]))
+        ++pos;
+    token.assign (text.data () + start, pos - start);
+    return true;
+}
+
+bool Context::Tokens::Read (std::string &token)
+{
+    if (context.NextToken (token))
+        return true;
+    return context.source && context.source->Read (token);
+}
+
+void Context::Show ()
+{
+    if (mode == INT_MODE)
+        display.ShowStack (int_stack);
+    else
+        display.ShowStack (stack);
+}
+
+void Context::Help ()
+{
+    display.Write ("commands:\n");
+    // Program commands
+    display.Write ("help\tdisplay this help screen\n");
+    display.Write ("quit\tpop the stack and exit\n");
+    // Display commands
+    for (RPNCalc::DisplayOps::iterator i = calc->DisplayBegin ();
+        i != calc->DisplayEnd (); ++i)
+        display.Write (i->first + "\t" + i->second->Help () + "\n");
+    // Calculator commands
+    for (RPNCalc::StackOps::iterator i = calc->StackBegin ();
+        i != calc->StackEnd (); ++i)
+        display.Write (i->first + "\t" + i->second->Help () + "\n");
+    for (RPNCalc::IntOps::iterator i = calc->IntBegin ();
+        i != calc->IntEnd (); ++i)
+        display.Write (i->first + "\t" + i->second->Help () + "\n");
+}
+
+bool Context::IsNumber (std::string_view token) const
+{
+    double x;
+    uint64_t y;
+    return mode == INT_MODE ? Parse (token, y) : Parse (token, x);
+}
+
+} // namespace jsp
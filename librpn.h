@@ -0,0 +1,138 @@
+// Reverse Polish Notation Calculator Library
+//
+// Copyright (C) 2007
+// Center for Perceptual Systems
+// University of Texas at Austin
+
+#ifndef LIBRPN_H
+#define LIBRPN_H
+
+#include "rpn.h"
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace jsp
+{
+
+// The calculator modes.  The values are stored in trace files.
+enum CalcMode
+{
+    BASIC_MODE = 'b',
+    HP35_MODE = '3',
+    SUPER_MODE = 's',
+    INT_MODE = 'i'
+};
+
+// A FileSink writes to a stdio stream
+class FileSink : public Sink
+{
+    public:
+    FileSink (FILE *fp) : fp (fp) { }
+    void Write (const char *s, size_t n) { std::fwrite (s, 1, n, fp); }
+    private:
+    FILE *fp;
+};
+
+// The enumerators are prefixed, so that they don't collide with macros
+// like OK and ERR in curses.h
+enum Status
+{
+    // All of the tokens were evaluated
+    EVAL_OK,
+    // Evaluation stopped at 'quit'
+    EVAL_QUIT,
+    // Evaluation stopped at a token that is not a number or a command
+    EVAL_UNKNOWN_TOKEN,
+    // Evaluation stopped at a command that failed
+    EVAL_ERROR
+};
+
+// The result of evaluating a string
+struct Result
+{
+    Status status;
+    // Where evaluation stopped, if it did not get to the end
+    size_t position;
+    // The token that evaluation stopped at
+    std::string token;
+    // What went wrong
+    std::string message;
+    // The stack after evaluation
+    size_t depth;
+    double value;
+    uint64_t int_value;
+};
+
+// A Context holds the state of a calculator: its mode, its stack, and
+// its display.
+//
+// It does not use iostreams.  Output goes to a Sink, which throws it
+// away by default, and commands that need more input, like 'prec', take
+// the next token of the string that is being evaluated or else read from
+// a Source.  Errors are returned in the Result instead of being thrown.
+class Context
+{
+    public:
+    Context (CalcMode mode = SUPER_MODE);
+    Context (const Context &) = delete;
+    Context &operator= (const Context &) = delete;
+
+    // Evaluate the whitespace separated tokens in a string
+    Result Evaluate (std::string_view str);
+
+    void SetSink (Sink *s);
+    void SetSource (Source *s) { source = s; }
+    // Show the stack after each token that changes it
+    void SetShowStack (bool b) { show_stack = b; }
+    // Ignore display commands, like 'hex'
+    void SetDisplayEnabled (bool b) { display_enabled = b; }
+    // Spill the stack to disk when it uses more than this much RAM
+    void SetMemoryLimit (size_t bytes);
+    void SetSpillDirectory (const std::string &dir);
+
+    // Write the stack or the list of commands to the sink
+    void Show ();
+    void Help ();
+
+    bool IsNumber (std::string_view token) const;
+    CalcMode Mode () const { return mode; }
+    std::string Version () const { return calc->Version (); }
+    RPNCalc &Calc () { return *calc; }
+    const Stack &GetStack () const { return stack; }
+    const IntStack &GetIntStack () const { return int_stack; }
+
+    private:
+    // Supplies the rest of the string being evaluated to the display,
+    // then falls back to the Context's source
+    class Tokens : public Source
+    {
+        public:
+        Tokens (Context &context) : context (context) { }
+        bool Read (std::string &token);
+        private:
+        Context &context;
+    };
+    template<typename S,typename T>
+    bool EvalToken (S &s, const std::string &token, Result &r);
+    bool NextToken (std::string &token);
+    CalcMode mode;
+    std::unique_ptr<RPNCalc> calc;
+    Stack stack;
+    IntStack int_stack;
+    NullSink null_sink;
+    Sink *sink;
+    Source *source;
+    Tokens tokens;
+    Display display;
+    bool show_stack;
+    bool display_enabled;
+    // The string being evaluated
+    std::string_view text;
+    size_t pos;
+};
+
+} // namespace jsp
+
+#endif // LIBRPN_H
@@ -7,15 +7,103 @@
 // jsp Wed Mar 14 13:07:41 CDT 2007
 
 #include "argv.h"
-#include "rpn.h"
+#include "librpn.h"
+#include "shard.h"
+#include "trace.h"
+#include <chrono>
 #include <iostream>
 #include <memory>
-#include <sstream>
 #include <stdexcept>
 
 using namespace std;
 using namespace jsp;
 
+// Reads the tokens that the display asks for from stdin
+//
+// The tokens are kept, so that they can be recorded with the command
+// that asked for them.
+class CinSource : public Source
+{
+    public:
+    bool Read (string &token)
+    {
+        cerr.flush ();
+        if (!(cin >> token))
+            return false;
+        read += " " + token;
+        return true;
+    }
+    string read;
+};
+
+// Loop until 'quit' or eof
+//
+// If 'trace' is not null, each token is recorded in it, along with the
+// tokens that it read from 'source'.
+void Run (Context &context, CinSource &source, TraceWriter *trace)
+{
+    typedef chrono::steady_clock clock;
+    clock::time_point last = clock::now ();
+
+    while (true)
+    {
+        // Check for more input
+        if (!cin)
+            break;
+
+        // Show a prompt
+        cerr << "> "; cerr.flush ();
+
+        // Get a string
+        string str;
+        cin >> str;
+
+        // Does it contain anything?
+        if (str.empty ())
+            continue;
+
+        source.read.clear ();
+        Result r = context.Evaluate (str);
+
+        if (trace)
+        {
+            const clock::time_point now = clock::now ();
+            TraceEntry e;
+            e.token = str + source.read;
+            e.usecs = chrono::duration_cast<chrono::microseconds> (now - last).count ();
+            e.checksum = TraceChecksum (context);
+            trace->Write (e);
+            last = now;
+        }
+
+        if (r.status == EVAL_QUIT)
+            break;
+        else if (r.status == EVAL_UNKNOWN_TOKEN)
+            cerr << str << "?" << endl;
+        else if (r.status == EVAL_ERROR)
+            cerr << r.message << endl;
+    }
+}
+
+// Print what a replay measured
+void Report (const ReplayStats &stats)
+{
+    const double secs = chrono::duration<double> (stats.total).count ();
+    cout << "entries\t" << stats.entries << endl;
+    cout << "tokens\t" << stats.tokens << endl;
+    cout << "recorded seconds\t" << stats.recorded_usecs / 1e6 << endl;
+    cout << "replay seconds\t" << secs << endl;
+    cout << "tokens/sec\t" << (secs > 0.0 ? stats.tokens / secs : 0.0) << endl;
+    cout << "command\tcount\tmean ns" << endl;
+    for (map<string,pair<ReplayStats::ns,size_t> >::const_iterator i = stats.latency.begin ();
+        i != stats.latency.end (); ++i)
+    {
+        cout << i->first << "\t"
+            << i->second.second << "\t"
+            << i->second.first.count () / i->second.second << endl;
+    }
+}
+
 int main (int argc, char *argv[])
 {
     try
@@ -24,13 +112,29 @@ int main (int argc, char *argv[])
         bool basic = false;
         bool hp35 = false;
         bool super = false;
+        bool integer = false;
         string fn;
+        string record;
+        string replay;
+        string batch;
+        size_t shards = sysconf (_SC_NPROCESSORS_ONLN);
+        string reduce = "sum";
+        size_t memory = 0;
+        string spill;
 
         jsp::CommandLine cl;
         cl.AddSpec ("help",     'h',    help,   "Show help");
         cl.AddSpec ("basic",    'b',    basic,  "Basic mode");
         cl.AddSpec ("hp35",     '3',    hp35,   "HP35 mode");
         cl.AddSpec ("super",    's',    super,  "Super mode (default)");
+        cl.AddSpec ("int",      'i',    integer, "Integer mode");
+        cl.AddSpec ("record",   'r',    record, "Record the session to a trace file");
+        cl.AddSpec ("replay",   'p',    replay, "Replay a trace file and report timing");
+        cl.AddSpec ("batch",    'f',    batch,  "Reduce the numbers in a file");
+        cl.AddSpec ("shards",   'n',    shards, "Number of worker processes for --batch");
+        cl.AddSpec ("reduce",   'e',    reduce, "Reduction for --batch (default sum)");
+        cl.AddSpec ("memory",   'm',    memory, "Spill the stack to disk above this many MB");
+        cl.AddSpec ("spill",    'd',    spill,  "Directory for stack spill files");
 
         cl.GroupArgs (argc, argv, 1);
         cl.ExtractBegin ();
@@ -38,23 +142,56 @@ int main (int argc, char *argv[])
         cl.Extract (basic);
         cl.Extract (hp35);
         cl.Extract (super);
+        cl.Extract (integer);
+        cl.Extract (record);
+        cl.Extract (replay);
+        cl.Extract (batch);
+        cl.Extract (shards);
+        cl.Extract (reduce);
+        cl.Extract (memory);
+        cl.Extract (spill);
         cl.ExtractEnd ();
 
         if (!cl.GetLeftOverArgs ().empty ())
             throw runtime_error ("usage: rpn " + cl.Usage () + "\n");
 
+        CalcMode mode = integer ? INT_MODE : basic ? BASIC_MODE : hp35 ? HP35_MODE : SUPER_MODE;
+
+        // A trace knows which mode it was recorded in
+        unique_ptr<TraceReader> reader;
+        if (!replay.empty ())
+        {
+            reader = unique_ptr<TraceReader> (new TraceReader (replay));
+            mode = static_cast<CalcMode> (reader->Mode ());
+        }
+
         // A Reverse Polish Notation Calculator
-        unique_ptr<BasicCalc> calc;
+        Context context (mode);
+        if (memory != 0)
+            context.SetMemoryLimit (memory << 20);
+        if (!spill.empty ())
+            context.SetSpillDirectory (spill);
 
-        if (basic)
-            calc = unique_ptr<BasicCalc> (new BasicCalc);
-        else if (hp35)
-            calc = unique_ptr<HP35> (new HP35);
-        else
-            calc = unique_ptr<SuperCalc> (new SuperCalc);
+        if (reader)
+        {
+            Report (Replay (context, *reader));
+            return 0;
+        }
+
+        if (!batch.empty ())
+        {
+            // Batch reductions are over doubles
+            if (mode == INT_MODE)
+                throw runtime_error ("--batch does not support --int");
+            Reduction *op = dynamic_cast<Reduction *> (context.Calc ().GetStackOp (reduce));
+            if (!op)
+                throw runtime_error (reduce + " is not a reduction");
+            cout << op->Reduce (ReduceShards (batch, shards)) << endl;
+            return 0;
+        }
 
         cerr << "RPN calculator, version "
-            << calc->Version ()
+            << context.Version ()
             << endl;
         cerr << "Copyright (C) 2007 Jeff Perry"
             << endl;
@@ -68,89 +205,24 @@ int main (int argc, char *argv[])
             return 0;
         }
 
-        // The calculator operates on a stack and a display
-        Stack stack;
-        Display display;
+        // The calculator writes its display to stderr
+        FileSink sink (stderr);
+        CinSource source;
+        context.SetSink (&sink);
+        context.SetSource (&source);
+        context.SetShowStack (true);
 
-        // Loop until 'quit' or eof
-        while (true)
-        {
-            // Check for more input
-            if (!cin)
-                break;
-
-            // Show a prompt
-            cerr << "> "; cerr.flush ();
-
-            // Get a string
-            string str;
-            cin >> str;
-
-            // Does it contain anything?
-            if (str.empty ())
-                continue;
-
-            // Save it in a stringstream
-            stringstream tmp (str);
-
-            // Try to get it into a double
-            double x;
-            tmp >> x;
-
-            // If it's a double, push it onto the stack
-            if (!tmp.fail ())
-            {
-                stack.Push (x);
-                // ... then show the stack
-                for (size_t i = 0; i < stack.Size (); ++i)
-                {
-                    double x  = stack.Get (i);
-                    display.Show (x);
-                }
-            }
-            // If it's a program command, do the command
-            else if (str == "quit")
-            {
-                break;
-            }
-            else if (str == "help")
-            {
-                cerr << "commands:" << endl;
-                // Program commands
-                cerr << "help\tdisplay this help screen" << endl;
-                cerr << "quit\tpop the stack and exit" << endl;
-                // Display commands
-                for (RPNCalc::DisplayOps::iterator i = calc->DisplayBegin ();
-                    i != calc->DisplayEnd (); ++i)
-                {
-                    cerr << i->first << "\t";
-                    cerr << i->second->Help () << endl;
-                }
-                // Calculator commands
-                for (RPNCalc::StackOps::iterator i = calc->StackBegin ();
-                    i != calc->StackEnd (); ++i)
-                {
-                    cerr << i->first << "\t";
-                    cerr << i->second->Help () << endl;
-                }
-            }
-            // If it's a calculator op, do the op
-            else if (calc->Lookup (str))
-            {
-                calc->Exec (str, stack, display);
-                // ... then show the stack
-                for (size_t i = 0; i < stack.Size (); ++i)
-                {
-                    double x  = stack.Get (i);
-                    display.Show (x);
-                }
-            }
-            else
-                cerr << str << "?" << endl;
-        }
+        unique_ptr<TraceWriter> writer;
+        if (!record.empty ())
+            writer = unique_ptr<TraceWriter> (new TraceWriter (record, mode));
+
+        Run (context, source, writer.get ());
 
         // Print the top of the stack and exit
-        cout << stack.Top () << endl;
+        if (mode == INT_MODE)
+            cout << context.GetIntStack ().Top () << endl;
+        else
+            cout << context.GetStack ().Top () << endl;
 
         return 0;
     }
@@ -10,133 +10,918 @@
 #define RPN_H
 
 #include "version.h"
-#include <bitset>
+#include <cerrno>
+#include <charconv>
 #include <cmath>
-#include <iostream>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <map>
 #include <limits>
-#include <locale>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
 #include <vector>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 namespace jsp
 {
 
-// A Stack is a normal stack, except that you can Pop() and Top() an
-// Empty() stack, in which case 0.0 is returned.
+// A SpillFile holds the chunks of a ChunkedArray that are spilled to
+// disk, in order from the start of the file.  The file is unlinked as
+// soon as it is created, and the chunks are memory mapped.
+//
+// It is implemented in spill.cc, which is the only part of the
+// calculator that needs POSIX.
+class SpillFile
+{
+    public:
+    SpillFile () : fd (-1) { }
+    ~SpillFile ();
+    SpillFile (const SpillFile &) = delete;
+    SpillFile &operator= (const SpillFile &) = delete;
+    // Where the file is created.  The default is $TMPDIR, or /var/tmp.
+    void SetDirectory (const std::string &d) { dir = d; }
+    const std::string &Directory () const { return dir; }
+    // Grow the file to hold chunk 'i', and map it
+    void *Map (size_t i, size_t bytes);
+    // Unmap chunk 'i', which must be the last one, and shrink the file.
+    // This does not fail.
+    void Unmap (void *chunk, size_t i, size_t bytes);
+    void Swap (SpillFile &f)
+    {
+        std::swap (dir, f.dir);
+        std::swap (fd, f.fd);
+    }
+    private:
+    std::string dir;
+    int fd;
+};
+
+// A ChunkedArray is an array that grows and shrinks at the end, like a
+// vector, but stores its elements in fixed size chunks.
+//
+// If a memory limit is set, the lowest chunks are spilled to a
+// SpillFile once there are too many chunks in RAM, and the operating
+// system pages them in and out as they are used.  Spilling does not
+// change the behavior of the array.
+template<typename T>
+class ChunkedArray
+{
+    public:
+    // Elements per chunk
+    static constexpr size_t CHUNK_BITS = 16;
+    static constexpr size_t CHUNK_SIZE = size_t (1) << CHUNK_BITS;
+    static constexpr size_t CHUNK_BYTES = CHUNK_SIZE * sizeof (T);
+    ChunkedArray () :
+        size (0),
+        cold (0),
+        hot_limit (std::numeric_limits<size_t>::max ())
+    {
+    }
+    // A copy has the same memory limit, and its own spill file
+    ChunkedArray (const ChunkedArray &a) :
+        size (0),
+        cold (0),
+        hot_limit (a.hot_limit)
+    {
+        file.SetDirectory (a.file.Directory ());
+        try
+        {
+            a.ForEach ([this] (const T &x) { PushBack (x); });
+        }
+        catch (...)
+        {
+            Clear ();
+            throw;
+        }
+    }
+    ChunkedArray (ChunkedArray &&a) :
+        ChunkedArray ()
+    {
+        Swap (a);
+    }
+    ChunkedArray &operator= (ChunkedArray a)
+    {
+        Swap (a);
+        return *this;
+    }
+    ~ChunkedArray () { Clear (); }
+    void Swap (ChunkedArray &a)
+    {
+        chunks.swap (a.chunks);
+        std::swap (size, a.size);
+        std::swap (cold, a.cold);
+        std::swap (hot_limit, a.hot_limit);
+        file.Swap (a.file);
+    }
+    size_t Size () const { return size; }
+    void PushBack (const T &x)
+    {
+        if (size == chunks.size () * CHUNK_SIZE)
+            Grow ();
+        (*this)[size++] = x;
+    }
+    // The array must not be empty
+    void PopBack ()
+    {
+        --size;
+        // Keep one empty chunk so that pushing and popping across a
+        // chunk boundary does not allocate every time
+        if (chunks.size () > 1 && size <= (chunks.size () - 2) * CHUNK_SIZE)
+            Shrink ();
+    }
+    void Clear ()
+    {
+        while (!chunks.empty ())
+            Shrink ();
+        size = 0;
+    }
+    T &operator[] (size_t i) { return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)]; }
+    const T &operator[] (size_t i) const { return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)]; }
+    // Call f(x) for each element, in order.
+    //
+    // This walks each chunk sequentially, which is the fastest way to
+    // read spilled chunks.
+    template<typename F>
+    void ForEach (F f) const
+    {
+        for (size_t i = 0; i < chunks.size (); ++i)
+        {
+            const size_t n = std::min (CHUNK_SIZE, size - std::min (size, i * CHUNK_SIZE));
+            for (size_t j = 0; j < n; ++j)
+                f (chunks[i][j]);
+        }
+    }
+    // Keep at most this many bytes of elements in RAM.  The rest are
+    // spilled.  At least one chunk is always kept in RAM.
+    void SetMemoryLimit (size_t bytes)
+    {
+        hot_limit = std::max (size_t (1), bytes / CHUNK_BYTES);
+        while (chunks.size () - cold > hot_limit)
+            Spill ();
+    }
+    void SetSpillDirectory (const std::string &dir) { file.SetDirectory (dir); }
+    // The number of chunks that are spilled
+    size_t Spilled () const { return cold; }
+    private:
+    // Add a chunk at the top
+    void Grow ()
+    {
+        chunks.push_back (new T[CHUNK_SIZE]);
+        if (chunks.size () - cold > hot_limit)
+            Spill ();
+    }
+    // Remove the chunk at the top
+    void Shrink ()
+    {
+        T *chunk = chunks.back ();
+        chunks.pop_back ();
+        // The spilled chunks are at the start of the file, in order
+        if (chunks.size () < cold)
+            file.Unmap (chunk, --cold, CHUNK_BYTES);
+        else
+            delete [] chunk;
+    }
+    // Move the lowest chunk that is in RAM to the spill file
+    void Spill ()
+    {
+        T *p = static_cast<T *> (file.Map (cold, CHUNK_BYTES));
+        std::memcpy (p, chunks[cold], CHUNK_BYTES);
+        delete [] chunks[cold];
+        chunks[cold] = p;
+        ++cold;
+    }
+    std::vector<T *> chunks;
+    size_t size;
+    // Chunks [0, cold) are spilled
+    size_t cold;
+    size_t hot_limit;
+    SpillFile file;
+};
+
+
+// A running sum that uses Neumaier's variant of Kahan summation.  The
+// low order bits that each addition loses from 'sum' are kept in 'comp'.
+template<typename T,bool EXACT = std::is_integral<T>::value>
+struct CompensatedSum
+{
+    constexpr CompensatedSum () : sum (), comp () { }
+    constexpr void Add (T x)
+    {
+        const T t = sum + x;
+        if ((sum < 0 ? -sum : sum) >= (x < 0 ? -x : x))
+            comp += (sum - t) + x;
+        else
+            comp += (x - t) + sum;
+        sum = t;
+    }
+    constexpr T Value () const { return sum + comp; }
+    T sum;
+    T comp;
+};
+
+// Integer sums are exact, so there is nothing to compensate
+template<typename T>
+struct CompensatedSum<T,true>
+{
+    constexpr CompensatedSum () : sum () { }
+    constexpr void Add (T x) { sum += x; }
+    constexpr T Value () const { return sum; }
+    T sum;
+};
+
+// A BasicStack is a normal stack, except that you can Pop() and Top()
+// an Empty() stack, in which case zero is returned.
 //
 // It also has a temporary register that you can use to store stuff.
-class Stack
+//
+// The elements are kept in a ChunkedArray, so the stack can spill to
+// disk when it is given a memory limit.
+template<typename T>
+class BasicStack
 {
     public:
-    size_t Size () const { return stack.size (); }
-    bool Empty () const { return stack.size () == 0; }
-    void Push (double x) { stack.push_back (x); }
-    double Pop ()
+    static constexpr size_t CHUNK_SIZE = ChunkedArray<T>::CHUNK_SIZE;
+    static constexpr size_t CHUNK_BYTES = ChunkedArray<T>::CHUNK_BYTES;
+    // The smallest, largest and sum of a set of elements
+    struct Summary
     {
-        double x = 0.0;
+        typedef T value_type;
+        T min;
+        T max;
+        CompensatedSum<T> sum;
+    };
+    BasicStack () : reg () { }
+    size_t Size () const { return stack.Size (); }
+    bool Empty () const { return stack.Size () == 0; }
+    void Push (T x) { stack.PushBack (x); }
+    T Pop ()
+    {
+        T x = T ();
         if (!Empty ())
         {
-            x = stack.back ();
-            stack.pop_back ();
+            x = stack[Size () - 1];
+            stack.PopBack ();
+            if (summaries.size () > Size () / CHUNK_SIZE)
+                summaries.pop_back ();
         }
         return x;
     }
-    double Top () const
+    T Top () const
     {
-        double x = 0.0;
+        T x = T ();
         if (!Empty ())
             x = Get (Size () - 1);
         return x;
     }
-    void Clear () { stack.clear (); }
-    double Get (size_t i) const
+    void Clear ()
+    {
+        stack.Clear ();
+        summaries.clear ();
+    }
+    T Get (size_t i) const
     {
         if (i >= Size ())
             throw std::runtime_error ("Invalid stack index");
         return stack[i];
     }
-    double GetReg () const { return reg; }
-    void SetReg (double x) { reg = x; }
+    void Set (size_t i, T x)
+    {
+        if (i >= Size ())
+            throw std::runtime_error ("Invalid stack index");
+        stack[i] = x;
+        if (summaries.size () > i / CHUNK_SIZE)
+            summaries.resize (i / CHUNK_SIZE);
+    }
+    // Call f(x) for each element, from the bottom of the stack to the top
+    template<typename F>
+    void ForEach (F f) const { stack.ForEach (f); }
+    // Summarize the whole stack.
+    //
+    // The summary of each full chunk and the chunks below it is cached,
+    // so this only has to look at the chunks that were filled since the
+    // last call, and at the partial chunk on top.
+    Summary Summarize () { return Summarize (std::less<T> ()); }
+    T GetReg () const { return reg; }
+    void SetReg (T x) { reg = x; }
+    void SetMemoryLimit (size_t bytes) { stack.SetMemoryLimit (bytes); }
+    void SetSpillDirectory (const std::string &dir) { stack.SetSpillDirectory (dir); }
+    size_t Spilled () const { return stack.Spilled (); }
+    protected:
+    // Summarize with the element ordering 'less'.  The cached summaries
+    // must have been made with the same ordering.
+    template<typename Less>
+    Summary Summarize (Less less)
+    {
+        const size_t full = Size () / CHUNK_SIZE;
+        while (summaries.size () < full)
+        {
+            const size_t begin = summaries.size () * CHUNK_SIZE;
+            summaries.push_back (Summarize (begin, begin + CHUNK_SIZE, less));
+        }
+        return Summarize (full * CHUNK_SIZE, Size (), less);
+    }
+    void ClearSummaries () { summaries.clear (); }
     private:
-    std::vector<double> stack;
-    double reg;
+    // The summary of the elements below 'end', given the summaries of
+    // the chunks below 'begin', which is at the start of a chunk
+    template<typename Less>
+    Summary Summarize (size_t begin, size_t end, Less less) const
+    {
+        Summary s = begin == 0 ? Summary () : summaries[begin / CHUNK_SIZE - 1];
+        for (size_t i = begin; i < end; ++i)
+        {
+            const T x = stack[i];
+            if (i == 0)
+            {
+                s.min = x;
+                s.max = x;
+            }
+            if (less (x, s.min))
+                s.min = x;
+            if (less (s.max, x))
+                s.max = x;
+            s.sum.Add (x);
+        }
+        return s;
+    }
+    ChunkedArray<T> stack;
+    // summaries[i] is the summary of chunks 0 through i
+    std::vector<Summary> summaries;
+    T reg;
+};
+
+typedef BasicStack<double> Stack;
+
+// An IntStack holds exact unsigned integers of a selectable bit width,
+// 8, 16, 32 or 64.  Values are truncated to the width when they are
+// pushed, so they wrap around like machine registers.  Signed
+// operations interpret the values as two's complement.
+class IntStack : public BasicStack<uint64_t>
+{
+    public:
+    IntStack () : width (64), summary_sgn (false) { }
+    unsigned Width () const { return width; }
+    void SetWidth (uint64_t w)
+    {
+        if (w != 8 && w != 16 && w != 32 && w != 64)
+            throw std::runtime_error ("Invalid integer width");
+        width = static_cast<unsigned> (w);
+        for (size_t i = 0; i < Size (); ++i)
+            Set (i, Get (i) & Mask ());
+        SetReg (GetReg () & Mask ());
+    }
+    uint64_t Mask () const
+    {
+        return width == 64 ? ~uint64_t (0) : (uint64_t (1) << width) - 1;
+    }
+    int64_t ToSigned (uint64_t x) const
+    {
+        const uint64_t sign = uint64_t (1) << (width - 1);
+        return static_cast<int64_t> ((x ^ sign) - sign);
+    }
+    void Push (uint64_t x) { BasicStack<uint64_t>::Push (x & Mask ()); }
+    // With 'sgn', the min and max are found by comparing the values as
+    // two's complement
+    Summary Summarize (bool sgn = false)
+    {
+        if (sgn != summary_sgn)
+        {
+            ClearSummaries ();
+            summary_sgn = sgn;
+        }
+        if (!sgn)
+            return BasicStack<uint64_t>::Summarize (std::less<uint64_t> ());
+        return BasicStack<uint64_t>::Summarize ([this] (uint64_t a, uint64_t b)
+            { return ToSigned (a) < ToSigned (b); });
+    }
+    private:
+    unsigned width;
+    bool summary_sgn;
+};
+
+// Bit manipulation primitives.  These compile to single instructions
+// where the compiler and target support it, and fall back to portable
+// code elsewhere.
+//
+// On x86-64, POPCNT and BMI2 are not part of the baseline instruction
+// set, so unless they are enabled at compile time (-mpopcnt, -mbmi2) the
+// instructions are reached through functions compiled for them, after
+// checking the CPU once at run time.
+#if defined(__GNUC__) && defined(__x86_64__)
+inline bool CpuHasPopcnt ()
+{
+    static const bool b = (__builtin_cpu_init (), __builtin_cpu_supports ("popcnt"));
+    return b;
+}
+
+inline bool CpuHasBmi2 ()
+{
+    static const bool b = (__builtin_cpu_init (), __builtin_cpu_supports ("bmi2"));
+    return b;
+}
+
+__attribute__ ((target ("popcnt")))
+inline unsigned PopCount64Popcnt (uint64_t x)
+{
+    return __builtin_popcountll (x);
+}
+
+__attribute__ ((target ("bmi2")))
+inline uint64_t DepositBits64Bmi2 (uint64_t x, uint64_t mask)
+{
+    return _pdep_u64 (x, mask);
+}
+
+__attribute__ ((target ("bmi2")))
+inline uint64_t ExtractBits64Bmi2 (uint64_t x, uint64_t mask)
+{
+    return _pext_u64 (x, mask);
+}
+#endif
+
+inline unsigned PopCount64 (uint64_t x)
+{
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__POPCNT__)
+    if (CpuHasPopcnt ())
+        return PopCount64Popcnt (x);
+#endif
+#if defined(__GNUC__)
+    return __builtin_popcountll (x);
+#else
+    unsigned n = 0;
+    for (; x; x &= x - 1)
+        ++n;
+    return n;
+#endif
+}
+
+// Undefined for x == 0
+inline unsigned CountLeadingZeros64 (uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll (x);
+#else
+    unsigned n = 0;
+    for (uint64_t b = uint64_t (1) << 63; !(x & b); b >>= 1)
+        ++n;
+    return n;
+#endif
+}
+
+// Undefined for x == 0
+inline unsigned CountTrailingZeros64 (uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll (x);
+#else
+    unsigned n = 0;
+    for (; !(x & 1); x >>= 1)
+        ++n;
+    return n;
+#endif
+}
+
+inline uint64_t ByteSwap64 (uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_bswap64 (x);
+#else
+    uint64_t y = 0;
+    for (int i = 0; i < 8; ++i, x >>= 8)
+        y = (y << 8) | (x & 0xFF);
+    return y;
+#endif
+}
+
+// The portable versions of DepositBits64() and ExtractBits64(), for
+// CPUs without BMI2.  They are separate so that they can be tested on
+// CPUs that have it.
+inline uint64_t DepositBits64Portable (uint64_t x, uint64_t mask)
+{
+    uint64_t y = 0;
+    for (uint64_t b = 1; mask; b += b)
+    {
+        if (x & b)
+            y |= mask & (~mask + 1);
+        mask &= mask - 1;
+    }
+    return y;
+}
+
+inline uint64_t ExtractBits64Portable (uint64_t x, uint64_t mask)
+{
+    uint64_t y = 0;
+    for (uint64_t b = 1; mask; b += b)
+    {
+        if (x & mask & (~mask + 1))
+            y |= b;
+        mask &= mask - 1;
+    }
+    return y;
+}
+
+// Scatter the low bits of x to the set bit positions of mask
+inline uint64_t DepositBits64 (uint64_t x, uint64_t mask)
+{
+#if defined(__BMI2__)
+    return _pdep_u64 (x, mask);
+#else
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (CpuHasBmi2 ())
+        return DepositBits64Bmi2 (x, mask);
+#endif
+    return DepositBits64Portable (x, mask);
+#endif
+}
+
+// Gather the bits of x at the set bit positions of mask into the low
+// bits of the result
+inline uint64_t ExtractBits64 (uint64_t x, uint64_t mask)
+{
+#if defined(__BMI2__)
+    return _pext_u64 (x, mask);
+#else
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (CpuHasBmi2 ())
+        return ExtractBits64Bmi2 (x, mask);
+#endif
+    return ExtractBits64Portable (x, mask);
+#endif
+}
+
+// Convert a string to an integer.
+//
+// Accepts decimal, '0x' hexadecimal and '0b' binary, with an optional
+// leading '-' that negates the value in two's complement.  Returns false
+// if the string is not an integer or does not fit in 64 bits.
+inline bool ParseInt (std::string_view str, uint64_t &x)
+{
+    const char *p = str.data ();
+    const char *end = p + str.size ();
+    bool neg = false;
+    if (p != end && *p == '-')
+    {
+        neg = true;
+        ++p;
+    }
+    int base = 10;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+    {
+        base = 16;
+        p += 2;
+    }
+    else if (end - p > 2 && p[0] == '0' && (p[1] == 'b' || p[1] == 'B'))
+    {
+        base = 2;
+        p += 2;
+    }
+    uint64_t y = 0;
+    const std::from_chars_result r = std::from_chars (p, end, y, base);
+    if (r.ec != std::errc () || r.ptr != end)
+        return false;
+    x = neg ? 0 - y : y;
+    return true;
+}
+
+// Convert a string to a double.
+//
+// The conversion does not depend on the locale.  Returns false unless
+// the whole string is a finite number.
+inline bool ParseDouble (std::string_view str, double &x)
+{
+    const char *p = str.data ();
+    const char *end = p + str.size ();
+    // from_chars() does not accept a leading '+'
+    if (end - p > 1 && *p == '+' && p[1] != '-')
+        ++p;
+    double y = 0.0;
+    const std::from_chars_result r = std::from_chars (p, end, y);
+    // from_chars() also accepts "nan", "inf" and "infinity"
+    if (r.ec != std::errc () || r.ptr != end || !std::isfinite (y))
+        return false;
+    x = y;
+    return true;
+}
+
+// A Sink receives the text written by a Display
+class Sink
+{
+    public:
+    virtual ~Sink () { }
+    virtual void Write (const char *s, size_t n) = 0;
+};
+
+// A NullSink throws away everything written to it
+class NullSink : public Sink
+{
+    public:
+    void Write (const char *, size_t) { }
+};
+
+// A Source supplies the tokens that a Display asks for, like the
+// precision.
+class Source
+{
+    public:
+    virtual ~Source () { }
+    // Returns false if there are no more tokens
+    virtual bool Read (std::string &token) = 0;
 };
 
 // A Display contains properties associated with an RPN calculator
 // display.
+//
+// It writes to a Sink and reads from a Source.  Without a Sink, its
+// output is thrown away.
 class Display
 {
     public:
-    Display () :
+    Display (Sink *sink = 0, Source *source = 0) :
+        sink (sink),
+        source (source),
+        prec (6),
+        lines (20),
+        offset (0),
         hex (false),
         bin (false),
-        thousands (false)
+        thousands (false),
+        sgn (false),
+        stats (false)
     {
     }
+    void SetSink (Sink *s) { sink = s; }
+    void SetSource (Source *s) { source = s; }
     void Prec ()
     {
-        std::streamsize p;
-        std::cerr << "Enter the precision: ";
-        std::cerr.flush ();
-        std::cin >> p;
-        std::cerr.precision (p);
+        Write ("Enter the precision: ");
+        std::string token;
+        if (!source || !source->Read (token))
+            throw std::runtime_error ("Missing precision");
+        unsigned p = 0;
+        const char *end = token.data () + token.size ();
+        const std::from_chars_result r = std::from_chars (token.data (), end, p);
+        if (r.ec != std::errc () || r.ptr != end)
+            throw std::runtime_error ("Invalid precision");
+        prec = p < MAX_PREC ? p : MAX_PREC;
+    };
+    void Lines ()
+    {
+        Write ("Enter the number of lines: ");
+        std::string token;
+        if (!source || !source->Read (token))
+            throw std::runtime_error ("Missing number of lines");
+        size_t n = 0;
+        const char *end = token.data () + token.size ();
+        const std::from_chars_result r = std::from_chars (token.data (), end, n);
+        if (r.ec != std::errc () || r.ptr != end || n == 0)
+            throw std::runtime_error ("Invalid number of lines");
+        lines = n;
+        offset = 0;
+    };
+    // Scroll one page down the stack, away from the top
+    void Page () { offset += lines; }
+    // Scroll back to the top of the stack
+    void View () { offset = 0; }
+    void Stats ()
+    {
+        stats = !stats;
+        Write (stats ? "stats on\n" : "stats off\n");
     };
     void Hex ()
     {
         hex = !hex;
-        std::cerr << "hex " << (hex ? "on" : "off") << std::endl;
+        Write (hex ? "hex on\n" : "hex off\n");
     };
     void Bin ()
     {
         bin = !bin;
-        std::cerr << "binary " << (bin ? "on" : "off") << std::endl;
+        Write (bin ? "binary on\n" : "binary off\n");
     };
     void Thousands ()
     {
         thousands = !thousands;
-        std::cerr << "thousands separator " << (thousands ? "on" : "off") << std::endl;
+        Write (thousands ? "thousands separator on\n" : "thousands separator off\n");
+    };
+    void Signed ()
+    {
+        sgn = !sgn;
+        Write (sgn ? "signed on\n" : "signed off\n");
     };
     void Show (double x)
     {
-        ShowDec (x);
+        char buf[4 * MAX_PREC];
+        char *p = buf;
+        p = FormatDec (p, x);
         // Show optional columns
         if (hex)
-            ShowHex (x);
+        {
+            *p++ = '\t';
+            p = FormatHex (p, static_cast<size_t> (x), 0);
+        }
         if (bin)
-            ShowBinary (x);
-        std::cerr << std::endl;
+        {
+            *p++ = '\t';
+            p = FormatBinary (p, static_cast<size_t> (x), std::numeric_limits<long>::digits);
+        }
+        *p++ = '\n';
+        WriteBuffer (buf, p);
+    }
+    // Show an integer that is 'width' bits wide.
+    //
+    // The line is formatted into a local buffer and written at once, so
+    // this does not allocate.
+    void Show (uint64_t x, unsigned width)
+    {
+        char buf[128];
+        char *p = buf;
+        p = FormatDec (p, x, width);
+        if (hex)
+        {
+            *p++ = '\t';
+            p = FormatHex (p, x, width / 4);
+        }
+        if (bin)
+        {
+            *p++ = '\t';
+            p = FormatBinary (p, x, width);
+        }
+        *p++ = '\n';
+        WriteBuffer (buf, p);
+    }
+    // Show the page of the stack that is in view, with the top of the
+    // stack last.
+    //
+    // Only the lines that are in view are formatted, and the stats are
+    // cached by the stack, so the cost does not depend on the depth of
+    // the stack.  If any of the stack is out of view, or if stats are
+    // on, a summary line comes first.
+    // The stack is not const, because showing its stats updates the
+    // stack's cached summaries
+    template<typename S>
+    void ShowStack (S &s)
+    {
+        const size_t n = s.Size ();
+        // Don't scroll past the bottom
+        if (offset != 0 && offset >= n)
+            offset = n == 0 ? 0 : (n - 1) / lines * lines;
+        const size_t end = n - offset;
+        const size_t begin = end > lines ? end - lines : 0;
+        if (begin != 0 || offset != 0 || stats)
+            ShowSummary (s, n - end + 1, n - begin);
+        for (size_t i = begin; i < end; ++i)
+            ShowEntry (s, i);
+    }
+    void Write (const std::string &s)
+    {
+        if (sink)
+            sink->Write (s.data (), s.size ());
     }
     private:
-    void ShowDecThousands (double x)
+    void ShowEntry (const BasicStack<double> &s, size_t i) { Show (s.Get (i)); }
+    void ShowEntry (const IntStack &s, size_t i) { Show (s.Get (i), s.Width ()); }
+    char *FormatValue (char *p, const BasicStack<double> &, double x) const { return FormatDec (p, x); }
+    char *FormatValue (char *p, const IntStack &s, uint64_t x) const { return FormatDec (p, x & s.Mask (), s.Width ()); }
+    BasicStack<double>::Summary Summarize (BasicStack<double> &s) const { return s.Summarize (); }
+    IntStack::Summary Summarize (IntStack &s) const { return s.Summarize (sgn); }
+    // Levels count down from the top of the stack, which is level 1
+    template<typename S>
+    void ShowSummary (S &s, size_t first, size_t last)
     {
-        // By default, no thousands separator is used.  However, if
-        // you specify the locale, the separator for that locale will
-        // be used.
-        std::stringstream ss;
-        ss.imbue (std::locale ("en_US"));
-        ss << std::fixed << x;
-        std::cerr << ss.str ();
+        char buf[8 * MAX_PREC];
+        char *p = buf;
+        p += std::snprintf (p, 128, "-- depth %zu", s.Size ());
+        if (first <= last)
+            p += std::snprintf (p, 128, ", levels %zu-%zu", first, last);
+        if (stats && !s.Empty ())
+        {
+            const typename S::Summary m = Summarize (s);
+            const char *labels[] = { ", min ", ", max ", ", sum " };
+            const typename S::Summary::value_type values[] = { m.min, m.max, m.sum.Value () };
+            for (int i = 0; i < 3; ++i)
+            {
+                std::memcpy (p, labels[i], 6);
+                p = FormatValue (p + 6, s, values[i]);
+            }
+        }
+        *p++ = '\n';
+        WriteBuffer (buf, p);
     }
-    void ShowDec (double x)
+    // Enough for the integer digits of any double, with separators
+    static const unsigned MAX_PREC = 512;
+    void WriteBuffer (const char *begin, const char *end)
     {
-        if (thousands)
-            ShowDecThousands (x);
-        else
-            std::cerr << std::fixed << x;
+        if (sink)
+            sink->Write (begin, end - begin);
     }
-    void ShowHex (double x)
+    // Insert a separator between each group of three digits
+    char *Group (char *begin, char *end) const
     {
-        std::cerr << "\t" << std::hex << std::uppercase << static_cast<size_t> (x);
+        const size_t n = end - begin;
+        const size_t commas = (n - 1) / 3;
+        char *q = end + commas;
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (i != 0 && i % 3 == 0)
+                *--q = ',';
+            *--q = end[-1 - static_cast<ptrdiff_t> (i)];
+        }
+        return end + commas;
     }
-    void ShowBinary (double x)
+    char *FormatDec (char *p, double x) const
     {
-        const size_t N = std::numeric_limits<long>::digits;
-        std::cerr << "\t" << std::bitset<N> (static_cast<size_t> (x));
+        // Leave room for the separators
+        const int size = 2 * MAX_PREC;
+        int n = std::snprintf (p, size, "%.*f", static_cast<int> (prec), x);
+        if (n < 0)
+            n = 0;
+        else if (n >= size)
+            n = size - 1;
+        char *end = p + n;
+        if (thousands && std::isfinite (x))
+        {
+            // By default, no thousands separator is used.
+            char *digits = p + (std::signbit (x) ? 1 : 0);
+            char *point = digits;
+            while (point < end && *point != '.')
+                ++point;
+            // Move the fraction out of the way while grouping
+            char fraction[MAX_PREC + 2];
+            const size_t f = end - point;
+            std::memcpy (fraction, point, f);
+            point = Group (digits, point);
+            std::memcpy (point, fraction, f);
+            end = point + f;
+        }
+        return end;
     }
+    char *FormatDec (char *p, uint64_t x, unsigned width) const
+    {
+        // Signed values are shown as a sign and a magnitude
+        if (sgn && width != 0 && (x >> (width - 1)) & 1)
+        {
+            *p++ = '-';
+            x = 0 - x;
+            if (width != 64)
+                x &= (uint64_t (1) << width) - 1;
+        }
+        // Write the digits backwards, then reverse them
+        char *q = p;
+        unsigned n = 0;
+        do
+        {
+            if (thousands && n != 0 && n % 3 == 0)
+                *q++ = ',';
+            *q++ = '0' + x % 10;
+            x /= 10;
+            ++n;
+        }
+        while (x);
+        for (char *a = p, *b = q - 1; a < b; ++a, --b)
+        {
+            const char c = *a;
+            *a = *b;
+            *b = c;
+        }
+        return q;
+    }
+    // Show at least 'digits' hexadecimal digits
+    char *FormatHex (char *p, uint64_t x, unsigned digits) const
+    {
+        unsigned n = 1;
+        while (n < 16 && (x >> (4 * n)) != 0)
+            ++n;
+        if (n < digits)
+            n = digits;
+        for (int i = 4 * (n - 1); i >= 0; i -= 4)
+            *p++ = "0123456789ABCDEF"[(x >> i) & 0xF];
+        return p;
+    }
+    char *FormatBinary (char *p, uint64_t x, unsigned digits) const
+    {
+        for (int i = digits - 1; i >= 0; --i)
+            *p++ = '0' + ((x >> i) & 1);
+        return p;
+    }
+    Sink *sink;
+    Source *source;
+    unsigned prec;
+    size_t lines;
+    size_t offset;
     bool hex;
     bool bin;
     bool thousands;
+    bool sgn;
+    bool stats;
 };
 
 template<typename Ty>
@@ -147,6 +932,24 @@ class Op
     virtual std::string Help () const = 0;
 };
 
+// gcc can evaluate the <cmath> functions in constant expressions, so
+// the operators that use them can be constexpr
+#if defined(__GNUC__) && !defined(__clang__)
+#define RPN_CMATH_CONSTEXPR constexpr
+#else
+#define RPN_CMATH_CONSTEXPR
+#endif
+
+// The Stack operators are shared with Formula, which runs them on a
+// FormulaStack.  Each one has a static Exec(s) that works on either kind
+// of stack, and Op<Stack>::operator() calls it.
+template<typename D>
+class StackOp : public Op<Stack>
+{
+    public:
+    void operator() (Stack &s) { D::Exec (s); }
+};
+
 // This helper ensures that you are not relying on function argument
 // ordering.
 //
@@ -154,27 +957,202 @@ class Op
 //
 //      s.Push(pow(s.Pop(),s.Pop()); // WRONG! x^y or y^x?
 //
+// D supplies the arithmetic as a static F(x,y).
+template<typename D>
 class BinaryStackOp : public Op<Stack>
 {
     public:
-    void operator() (Stack &s)
+    void operator() (Stack &s) { Exec (s); }
+    template<typename S>
+    static constexpr void Exec (S &s)
     {
         double y = s.Pop ();
         double x = s.Pop ();
-        s.Push (F (x, y));
+        s.Push (D::F (x, y));
     }
-    virtual double F (double x, double y) const = 0;
 };
 
+template<typename D>
 class UnaryStackOp : public Op<Stack>
 {
     public:
-    void operator() (Stack &s)
+    void operator() (Stack &s) { Exec (s); }
+    template<typename S>
+    static constexpr void Exec (S &s)
     {
         double x = s.Pop ();
-        s.Push (F (x));
+        s.Push (D::F (x));
+    }
+};
+
+// Moments hold the partial state of a reduction over a set of numbers.
+//
+// Two Moments computed over disjoint sets can be merged into the Moments
+// of their union, so a reduction can be split into shards.  The count,
+// min and max merge exactly.  The sum is compensated, and the mean and
+// variance use the pairwise update of Chan, Golub and LeVeque.
+class Moments
+{
+    public:
+    constexpr Moments () :
+        count (0),
+        sum (),
+        min (std::numeric_limits<double>::infinity ()),
+        max (-std::numeric_limits<double>::infinity ()),
+        mean (0.0),
+        m2 (0.0)
+    {
+    }
+    constexpr void Add (double x)
+    {
+        ++count;
+        sum.Add (x);
+        if (x < min)
+            min = x;
+        if (x > max)
+            max = x;
+        const double delta = x - mean;
+        mean += delta / count;
+        m2 += delta * (x - mean);
+    }
+    void Merge (const Moments &m)
+    {
+        if (m.count == 0)
+            return;
+        const uint64_t n = count + m.count;
+        sum.Add (m.sum.sum);
+        sum.Add (m.sum.comp);
+        if (m.min < min)
+            min = m.min;
+        if (m.max > max)
+            max = m.max;
+        const double delta = m.mean - mean;
+        mean += delta * m.count / n;
+        m2 += m.m2 + delta * delta * count / n * m.count;
+        count = n;
+    }
+    constexpr uint64_t Count () const { return count; }
+    constexpr double Sum () const { return sum.Value (); }
+    constexpr double Min () const { return count ? min : 0.0; }
+    constexpr double Max () const { return count ? max : 0.0; }
+    constexpr double Mean () const { return mean; }
+    // Sample variance
+    constexpr double Var () const { return count > 1 ? m2 / (count - 1) : 0.0; }
+    // The partial state is a single line of text:
+    //
+    //      count sum comp min max mean m2
+    //
+    // The count is decimal, and the others are hexadecimal floating
+    // point so that they survive the trip exactly.
+    std::string Serialize () const
+    {
+        char buf[256];
+        std::snprintf (buf, sizeof (buf), "%llu %a %a %a %a %a %a\n",
+            static_cast<unsigned long long> (count),
+            sum.sum, sum.comp, min, max, mean, m2);
+        return buf;
+    }
+    static Moments Deserialize (const std::string &str)
+    {
+        Moments m;
+        const char *p = str.c_str ();
+        char *end;
+        errno = 0;
+        m.count = std::strtoull (p, &end, 10);
+        double *fields[] = { &m.sum.sum, &m.sum.comp, &m.min, &m.max, &m.mean, &m.m2 };
+        if (end == p || errno != 0)
+            throw std::runtime_error ("Invalid partial state");
+        for (size_t i = 0; i < sizeof (fields) / sizeof (fields[0]); ++i)
+        {
+            p = end;
+            *fields[i] = std::strtod (p, &end);
+            if (end == p)
+                throw std::runtime_error ("Invalid partial state");
+        }
+        return m;
+    }
+    private:
+    uint64_t count;
+    CompensatedSum<double> sum;
+    double min;
+    double max;
+    double mean;
+    double m2;
+};
+
+// A reduction replaces the whole stack with a single number computed
+// from the Moments of the stack.
+//
+// Reduce() lets the Moments come from somewhere else, like a sharded
+// batch run.
+class Reduction : public Op<Stack>
+{
+    public:
+    virtual double Reduce (const Moments &m) const = 0;
+};
+
+// D supplies the number as a static F(m)
+template<typename D>
+class ReduceStackOp : public Reduction
+{
+    public:
+    void operator() (Stack &s) { Exec (s); }
+    double Reduce (const Moments &m) const { return D::F (m); }
+    template<typename S>
+    static constexpr void Exec (S &s)
+    {
+        Moments m;
+        s.ForEach ([&m] (double x) { m.Add (x); });
+        s.Clear ();
+        s.Push (D::F (m));
+    }
+};
+
+// The integer versions also get the width of the stack, in bits
+class BinaryIntOp : public Op<IntStack>
+{
+    public:
+    void operator() (IntStack &s)
+    {
+        uint64_t y = s.Pop ();
+        uint64_t x = s.Pop ();
+        s.Push (F (x, y, s.Width ()));
+    }
+    virtual uint64_t F (uint64_t x, uint64_t y, unsigned w) const = 0;
+};
+
+class UnaryIntOp : public Op<IntStack>
+{
+    public:
+    void operator() (IntStack &s)
+    {
+        uint64_t x = s.Pop ();
+        s.Push (F (x, s.Width ()));
+    }
+    virtual uint64_t F (uint64_t x, unsigned w) const = 0;
+};
+
+// Runs one of the calculators' stack operations, which only move values
+// around, on an IntStack.  D is the operation, with a static Exec(s).
+template<typename D>
+class IntStackOp : public Op<IntStack>
+{
+    public:
+    void operator() (IntStack &s) { D::Exec (s); }
+    std::string Help () const { return D ().Help (); }
+};
+
+// Division fails when y is zero.  The divisor is checked before anything
+// is popped, so a failure leaves the stack as it was.
+class DivisionIntOp : public BinaryIntOp
+{
+    public:
+    void operator() (IntStack &s)
+    {
+        if (s.Top () == 0)
+            throw std::runtime_error ("Division by zero");
+        BinaryIntOp::operator() (s);
     }
-    virtual double F (double x) const = 0;
 };
 
 class RPNCalc
@@ -183,9 +1161,7 @@ class RPNCalc
     virtual ~RPNCalc () { }
     virtual std::string Version () const
     {
-        std::stringstream ss;
-        ss << MAJOR_VERSION << "." << MINOR_VERSION;
-        return ss.str ();
+        return std::to_string (MAJOR_VERSION) + "." + std::to_string (MINOR_VERSION);
     }
     void Add (const std::string &name, Op<Stack> *stack_op)
     {
@@ -195,15 +1171,30 @@ class RPNCalc
     {
         display_ops[name] = display_op;
     }
+    void Add (const std::string &name, Op<IntStack> *int_op)
+    {
+        int_ops[name] = int_op;
+    }
     bool Lookup (const std::string &str) const
     {
         if (stack_ops.find (str) != stack_ops.end ())
             return true;
         else if (display_ops.find (str) != display_ops.end ())
             return true;
+        else if (int_ops.find (str) != int_ops.end ())
+            return true;
         else
             return false;
     }
+    bool IsDisplayOp (const std::string &str) const
+    {
+        return display_ops.find (str) != display_ops.end ();
+    }
+    Op<Stack> *GetStackOp (const std::string &str) const
+    {
+        StackOps::const_iterator i = stack_ops.find (str);
+        return i == stack_ops.end () ? 0 : i->second;
+    }
     void Exec (const std::string &str, Stack &stack, Display &display)
     {
         if (stack_ops.find (str) != stack_ops.end ())
@@ -213,18 +1204,63 @@ class RPNCalc
         else
             throw std::runtime_error ("Invalid operator");
     }
+    void Exec (const std::string &str, IntStack &stack, Display &display)
+    {
+        if (int_ops.find (str) != int_ops.end ())
+            (*int_ops[str]) (stack);
+        else if (display_ops.find (str) != display_ops.end ())
+            (*display_ops[str]) (display);
+        else
+            throw std::runtime_error ("Invalid operator");
+    }
     typedef std::map<std::string,Op<Stack> *> StackOps;
     typedef std::map<std::string,Op<Display> *> DisplayOps;
+    typedef std::map<std::string,Op<IntStack> *> IntOps;
     StackOps::iterator StackBegin () { return stack_ops.begin (); }
     StackOps::iterator StackEnd () { return stack_ops.end (); }
     DisplayOps::iterator DisplayBegin () { return display_ops.begin (); }
     DisplayOps::iterator DisplayEnd () { return display_ops.end (); }
+    IntOps::iterator IntBegin () { return int_ops.begin (); }
+    IntOps::iterator IntEnd () { return int_ops.end (); }
     private:
     StackOps stack_ops;
     DisplayOps display_ops;
+    IntOps int_ops;
 };
 
-const double PI = 2.0 * std::asin (1.0);
+constexpr double PI = 3.14159265358979323846;
+
+// Display operations that work the same way for every calculator
+struct HexOp : public Op<Display> {
+    void operator() (Display &d) { d.Hex (); }
+    std::string Help () const { return "toggle hexadecimal display"; }
+};
+struct BinOp : public Op<Display> {
+    void operator() (Display &d) { d.Bin (); }
+    std::string Help () const { return "toggle binary display"; }
+};
+struct ThousandsOp : public Op<Display> {
+    void operator() (Display &d) { d.Thousands (); }
+    std::string Help () const { return "toggle display of thousands separator"; }
+};
+struct ViewOp : public Op<Display> {
+    void operator() (Display &d) { d.View (); }
+    std::string Help () const { return "scroll the display to the top of the stack"; }
+};
+struct PageOp : public Op<Display> {
+    void operator() (Display &d) { d.Page (); }
+    std::string Help () const { return "scroll the display down one page"; }
+};
+struct LinesOp : public Op<Display> {
+    void operator() (Display &d) { d.Lines (); }
+    std::string Help () const { return "change the number of lines in a page"; }
+};
+struct StatsOp : public Op<Display> {
+    void operator() (Display &d) { d.Stats (); }
+    std::string Help () const { return "toggle display of stack min, max and sum"; }
+};
+
+template<size_t N> class Formula;
 
 class BasicCalc : public RPNCalc
 {
@@ -241,40 +1277,44 @@ class BasicCalc : public RPNCalc
         Add ("hex", &hex);
         Add ("bin", &bin);
         Add ("prec", &prec);
+        Add ("view", &view);
+        Add ("page", &page);
+        Add ("lines", &lines);
+        Add ("stats", &stats);
     }
     private:
-    struct PlusOp : public BinaryStackOp {
-        double F (double x, double y) const { return x + y; }
+    template<size_t N> friend class Formula;
+    struct PlusOp : public BinaryStackOp<PlusOp> {
+        static constexpr double F (double x, double y) { return x + y; }
         std::string Help () const { return "x+y"; }
     } plus;
-    struct MinusOp : public BinaryStackOp {
-        double F (double x, double y) const { return x - y; }
+    struct MinusOp : public BinaryStackOp<MinusOp> {
+        static constexpr double F (double x, double y) { return x - y; }
         std::string Help () const { return "x-y"; }
     } minus;
-    struct TimesOp : public BinaryStackOp {
-        double F (double x, double y) const { return x * y; }
+    struct TimesOp : public BinaryStackOp<TimesOp> {
+        static constexpr double F (double x, double y) { return x * y; }
         std::string Help () const { return "x*y"; }
     } times;
-    struct DividesOp : public BinaryStackOp {
-        double F (double x, double y) const { return x / y; }
+    struct DividesOp : public BinaryStackOp<DividesOp> {
+        static constexpr double F (double x, double y) { return x / y; }
         std::string Help () const { return "x/y"; }
     } divides;
-    struct PiOp : public Op<Stack> {
-        void operator() (Stack &s) { s.Push (2.0 * std::asin (1.0)); }
+    struct PiOp : public StackOp<PiOp> {
+        template<typename S>
+        static constexpr void Exec (S &s) { s.Push (PI); }
         std::string Help () const { return "pi"; }
     } pi;
-    struct HexOp : public Op<Display> {
-        void operator() (Display &d) { d.Hex (); }
-        std::string Help () const { return "toggle hexadecimal display"; }
-    } hex;
-    struct BinOp : public Op<Display> {
-        void operator() (Display &d) { d.Bin (); }
-        std::string Help () const { return "toggle binary display"; }
-    } bin;
+    HexOp hex;
+    BinOp bin;
     struct PrecOp : public Op<Display> {
         void operator() (Display &d) { d.Prec (); }
         std::string Help () const { return "change the display precision"; }
     } prec;
+    ViewOp view;
+    PageOp page;
+    LinesOp lines;
+    StatsOp stats;
 };
 
 class HP35 : public BasicCalc
@@ -304,92 +1344,101 @@ class HP35 : public BasicCalc
         Add ("clx", &clx);
     }
     private:
-    struct PowOp : public BinaryStackOp {
-        double F (double x, double y) const { return std::pow (y, x); }
+    template<size_t N> friend class Formula;
+    // IntCalc shares the operations that only move values around
+    friend class IntCalc;
+    struct PowOp : public BinaryStackOp<PowOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x, double y) { return std::pow (y, x); }
         std::string Help () const { return "x^y"; }
     } pow;
-    struct Log10Op : public UnaryStackOp {
-        double F (double x) const { return std::log10 (x); }
+    struct Log10Op : public UnaryStackOp<Log10Op> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::log10 (x); }
         std::string Help () const { return "log base 10 of x"; }
     } log10;
-    struct LogOp : public UnaryStackOp {
-        double F (double x) const { return std::log (x); }
+    struct LogOp : public UnaryStackOp<LogOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::log (x); }
         std::string Help () const { return "natural log of x"; }
     } log;
-    struct ExpOp : public UnaryStackOp {
-        double F (double x) const { return std::exp (x); }
+    struct ExpOp : public UnaryStackOp<ExpOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::exp (x); }
         std::string Help () const { return "e^x"; }
     } exp;
-    struct ClearOp : public Op<Stack> {
-        void operator() (Stack &s) { s.Clear (); }
+    struct ClearOp : public StackOp<ClearOp> {
+        template<typename S>
+        static constexpr void Exec (S &s) { s.Clear (); }
         std::string Help () const { return "clear the stack"; }
     } clear;
-    struct SqrtOp : public UnaryStackOp {
-        double F (double x) const { return std::sqrt (x); }
+    struct SqrtOp : public UnaryStackOp<SqrtOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::sqrt (x); }
         std::string Help () const { return "square root of x"; }
     } sqrt;
-    struct SinOp : public UnaryStackOp {
-        double F (double x) const { return std::sin (x * PI / 180.0); }
+    struct SinOp : public UnaryStackOp<SinOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::sin (x * PI / 180.0); }
         std::string Help () const { return "sine of x"; }
     } sin;
-    struct ArcSinOp : public UnaryStackOp {
-        double F (double x) const { return std::asin (x) * 180.0 / PI; }
+    struct ArcSinOp : public UnaryStackOp<ArcSinOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::asin (x) * 180.0 / PI; }
         std::string Help () const { return "arcsine of x"; }
     } asin;
-    struct CosOp : public UnaryStackOp {
-        double F (double x) const { return std::cos (x * PI / 180.0); }
+    struct CosOp : public UnaryStackOp<CosOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::cos (x * PI / 180.0); }
         std::string Help () const { return "cosine of x"; }
     } cos;
-    struct ArcCosOp : public UnaryStackOp {
-        double F (double x) const { return std::acos (x) * 180.0 / PI; }
+    struct ArcCosOp : public UnaryStackOp<ArcCosOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::acos (x) * 180.0 / PI; }
         std::string Help () const { return "arccosine of x"; }
     } acos;
-    struct TanOp : public UnaryStackOp {
-        double F (double x) const { return std::tan (x * PI / 180.0); }
+    struct TanOp : public UnaryStackOp<TanOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::tan (x * PI / 180.0); }
         std::string Help () const { return "tangent of x"; }
     } tan;
-    struct ArcTanOp : public UnaryStackOp {
-        double F (double x) const { return std::atan (x) * 180.0 / PI; }
+    struct ArcTanOp : public UnaryStackOp<ArcTanOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::atan (x) * 180.0 / PI; }
         std::string Help () const { return "arctangent of x"; }
     } atan;
-    struct InvOp : public UnaryStackOp {
-        double F (double x) const { return 1.0 / x; }
+    struct InvOp : public UnaryStackOp<InvOp> {
+        static constexpr double F (double x) { return 1.0 / x; }
         std::string Help () const { return "1/x"; }
     } inv;
-    struct SwapOp : public Op<Stack> {
-        void operator() (Stack &s)
+    struct SwapOp : public StackOp<SwapOp> {
+        template<typename S>
+        static constexpr void Exec (S &s)
         {
-            double y = s.Pop ();
-            double x = s.Pop ();
+            auto y = s.Pop ();
+            auto x = s.Pop ();
             s.Push (y);
             s.Push (x);
         }
         std::string Help () const { return "swap x and y"; }
     } swap;
-    struct StoreOp : public Op<Stack> {
-        void operator() (Stack &s)
+    struct StoreOp : public StackOp<StoreOp> {
+        template<typename S>
+        static constexpr void Exec (S &s)
         {
             s.SetReg (s.Top ());
         }
         std::string Help () const { return "store x (see rcl)"; }
     } store;
-    struct RecallOp : public Op<Stack> {
-        void operator() (Stack &s)
+    struct RecallOp : public StackOp<RecallOp> {
+        template<typename S>
+        static constexpr void Exec (S &s)
         {
             s.Push (s.GetReg ());
         }
         std::string Help () const { return "recall x (see sto)"; }
     } recall;
-    struct DupOp : public Op<Stack> {
-        void operator() (Stack &s) { s.Push (s.Top ()); }
+    struct DupOp : public StackOp<DupOp> {
+        template<typename S>
+        static constexpr void Exec (S &s) { s.Push (s.Top ()); }
         std::string Help () const { return "duplicate x"; }
     } dup;
-    struct ChsOp : public UnaryStackOp {
-        double F (double x) const { return -x; }
+    struct ChsOp : public UnaryStackOp<ChsOp> {
+        static constexpr double F (double x) { return -x; }
         std::string Help () const { return "change sign of x"; }
     } chs;
-    struct ClxOp : public Op<Stack> {
-        void operator() (Stack &s) { s.Pop (); }
+    struct ClxOp : public StackOp<ClxOp> {
+        template<typename S>
+        static constexpr void Exec (S &s) { s.Pop (); }
         std::string Help () const { return "clear x"; }
     } clx;
 };
@@ -403,48 +1452,813 @@ class SuperCalc : public HP35
         Add ("lg", &lg);
         Add ("noop", &noop);
         Add ("sum", &sum);
+        Add ("count", &count);
+        Add ("min", &min);
+        Add ("max", &max);
+        Add ("mean", &mean);
+        Add ("var", &var);
         Add ("deg", &deg);
         Add ("rad", &rad);
         Add (",", &thousands);
     }
     private:
-    struct LgOp : public Op<Stack> {
-        void operator() (Stack &s)
-        {
-            const double LOG2 = std::log10 (2.0);
-            s.Push (std::log10 (s.Pop ()) / LOG2);
-        }
+    template<size_t N> friend class Formula;
+    struct LgOp : public UnaryStackOp<LgOp> {
+        static RPN_CMATH_CONSTEXPR double F (double x) { return std::log10 (x) / std::log10 (2.0); }
         std::string Help () const { return "log base 2 of x"; }
     } lg;
-    struct NoOp : public Op<Stack> {
-        void operator() (Stack &) { }
+    struct NoOp : public StackOp<NoOp> {
+        template<typename S>
+        static constexpr void Exec (S &) { }
         std::string Help () const { return "do nothing"; }
     } noop;
-    struct SumOp : public Op<Stack> {
-        void operator() (Stack &s)
-        {
-            double sum = 0.0;
-            const size_t N = s.Size ();
-            for (size_t i = 0; i < N; ++i)
-                sum += s.Pop ();
-            s.Push (sum);
-        }
+    struct SumOp : public ReduceStackOp<SumOp> {
+        static constexpr double F (const Moments &m) { return m.Sum (); }
         std::string Help () const { return "sum all numbers on the stack"; }
     } sum;
-    struct DegOp : public UnaryStackOp {
-        double F (double x) const { return x * 180.0 / PI; }
+    struct CountOp : public ReduceStackOp<CountOp> {
+        static constexpr double F (const Moments &m) { return m.Count (); }
+        std::string Help () const { return "count all numbers on the stack"; }
+    } count;
+    struct MinOp : public ReduceStackOp<MinOp> {
+        static constexpr double F (const Moments &m) { return m.Min (); }
+        std::string Help () const { return "minimum of all numbers on the stack"; }
+    } min;
+    struct MaxOp : public ReduceStackOp<MaxOp> {
+        static constexpr double F (const Moments &m) { return m.Max (); }
+        std::string Help () const { return "maximum of all numbers on the stack"; }
+    } max;
+    struct MeanOp : public ReduceStackOp<MeanOp> {
+        static constexpr double F (const Moments &m) { return m.Mean (); }
+        std::string Help () const { return "mean of all numbers on the stack"; }
+    } mean;
+    struct VarOp : public ReduceStackOp<VarOp> {
+        static constexpr double F (const Moments &m) { return m.Var (); }
+        std::string Help () const { return "sample variance of all numbers on the stack"; }
+    } var;
+    struct DegOp : public UnaryStackOp<DegOp> {
+        static constexpr double F (double x) { return x * 180.0 / PI; }
         std::string Help () const { return "change x to degrees from radians"; }
     } deg;
-    struct RadOp : public UnaryStackOp {
-        double F (double x) const { return x * PI / 180; }
+    struct RadOp : public UnaryStackOp<RadOp> {
+        static constexpr double F (double x) { return x * PI / 180; }
         std::string Help () const { return "change x to radians from degrees"; }
     } rad;
-    struct ThousandsOp : public Op<Display> {
-        void operator() (Display &d) { d.Thousands (); }
-        std::string Help () const { return "toggle dislay of thousands separator"; }
-    } thousands;
+    ThousandsOp thousands;
+};
+
+// An integer calculator for bit twiddling.
+//
+// It operates on an IntStack instead of a Stack.
+class IntCalc : public RPNCalc
+{
+    public:
+    IntCalc ()
+    {
+        // Add the IntStack operations
+        Add ("+", &plus);
+        Add ("-", &minus);
+        Add ("*", &times);
+        Add ("/", &divides);
+        Add ("%", &mod);
+        Add ("chs", &chs);
+        Add ("and", &and_);
+        Add ("or", &or_);
+        Add ("xor", &xor_);
+        Add ("not", &not_);
+        Add ("shl", &shl);
+        Add ("shr", &shr);
+        Add ("sar", &sar);
+        Add ("rol", &rol);
+        Add ("ror", &ror);
+        Add ("popcnt", &popcnt);
+        Add ("clz", &clz);
+        Add ("ctz", &ctz);
+        Add ("bswap", &bswap);
+        Add ("pdep", &pdep);
+        Add ("pext", &pext);
+        Add ("width", &width);
+        Add ("clr", &clear);
+        Add ("clx", &clx);
+        Add ("dup", &dup);
+        Add ("swap", &swap);
+        Add ("sto", &store);
+        Add ("rcl", &recall);
+        // Add the Display operations
+        Add ("hex", &hex);
+        Add ("bin", &bin);
+        Add ("sgn", &sgn);
+        Add (",", &thousands);
+        Add ("view", &view);
+        Add ("page", &page);
+        Add ("lines", &lines);
+        Add ("stats", &stats);
+    }
+    private:
+    struct PlusOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const { return x + y; }
+        std::string Help () const { return "x+y"; }
+    } plus;
+    struct MinusOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const { return x - y; }
+        std::string Help () const { return "x-y"; }
+    } minus;
+    struct TimesOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const { return x * y; }
+        std::string Help () const { return "x*y"; }
+    } times;
+    struct DividesOp : public DivisionIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const { return x / y; }
+        std::string Help () const { return "unsigned x/y"; }
+    } divides;
+    struct ModOp : public DivisionIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const { return x % y; }
+        std::string Help () const { return "unsigned x mod y"; }
+    } mod;
+    struct ChsOp : public UnaryIntOp {
+        uint64_t F (uint64_t x, unsigned) const { return 0 - x; }
+        std::string Help () const { return "two's complement of x"; }
+    } chs;
+    struct AndOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const { return x & y; }
+        std::string Help () const { return "x and y"; }
+    } and_;
+    struct OrOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const { return x | y; }
+        std::string Help () const { return "x or y"; }
+    } or_;
+    struct XorOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const { return x ^ y; }
+        std::string Help () const { return "x xor y"; }
+    } xor_;
+    struct NotOp : public UnaryIntOp {
+        uint64_t F (uint64_t x, unsigned) const { return ~x; }
+        std::string Help () const { return "complement of x"; }
+    } not_;
+    struct ShlOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned w) const
+        {
+            return y < w ? x << y : 0;
+        }
+        std::string Help () const { return "shift x left by y"; }
+    } shl;
+    struct ShrOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned w) const
+        {
+            return y < w ? x >> y : 0;
+        }
+        std::string Help () const { return "logical shift x right by y"; }
+    } shr;
+    struct SarOp : public Op<IntStack> {
+        void operator() (IntStack &s)
+        {
+            uint64_t y = s.Pop ();
+            int64_t x = s.ToSigned (s.Pop ());
+            // Shifting by the width or more fills with the sign bit
+            if (y >= s.Width ())
+                y = s.Width () - 1;
+            s.Push (static_cast<uint64_t> (x >> y));
+        }
+        std::string Help () const { return "arithmetic shift x right by y"; }
+    } sar;
+    struct RolOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned w) const
+        {
+            y %= w;
+            return y == 0 ? x : (x << y) | (x >> (w - y));
+        }
+        std::string Help () const { return "rotate x left by y"; }
+    } rol;
+    struct RorOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned w) const
+        {
+            y %= w;
+            return y == 0 ? x : (x >> y) | (x << (w - y));
+        }
+        std::string Help () const { return "rotate x right by y"; }
+    } ror;
+    struct PopcntOp : public UnaryIntOp {
+        uint64_t F (uint64_t x, unsigned) const { return PopCount64 (x); }
+        std::string Help () const { return "number of bits set in x"; }
+    } popcnt;
+    struct ClzOp : public UnaryIntOp {
+        uint64_t F (uint64_t x, unsigned w) const
+        {
+            return x == 0 ? w : CountLeadingZeros64 (x) - (64 - w);
+        }
+        std::string Help () const { return "count leading zeros of x"; }
+    } clz;
+    struct CtzOp : public UnaryIntOp {
+        uint64_t F (uint64_t x, unsigned w) const
+        {
+            return x == 0 ? w : CountTrailingZeros64 (x);
+        }
+        std::string Help () const { return "count trailing zeros of x"; }
+    } ctz;
+    struct BswapOp : public UnaryIntOp {
+        uint64_t F (uint64_t x, unsigned w) const
+        {
+            return ByteSwap64 (x) >> (64 - w);
+        }
+        std::string Help () const { return "reverse the bytes of x"; }
+    } bswap;
+    struct PdepOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const
+        {
+            return DepositBits64 (x, y);
+        }
+        std::string Help () const { return "deposit bits of x at mask y"; }
+    } pdep;
+    struct PextOp : public BinaryIntOp {
+        uint64_t F (uint64_t x, uint64_t y, unsigned) const
+        {
+            return ExtractBits64 (x, y);
+        }
+        std::string Help () const { return "extract bits of x at mask y"; }
+    } pext;
+    struct WidthOp : public Op<IntStack> {
+        void operator() (IntStack &s)
+        {
+            // Pop the width only after it is accepted
+            s.SetWidth (s.Top ());
+            s.Pop ();
+        }
+        std::string Help () const { return "set the width to x bits (8, 16, 32 or 64)"; }
+    } width;
+    IntStackOp<HP35::ClearOp> clear;
+    IntStackOp<HP35::ClxOp> clx;
+    IntStackOp<HP35::DupOp> dup;
+    IntStackOp<HP35::SwapOp> swap;
+    IntStackOp<HP35::StoreOp> store;
+    IntStackOp<HP35::RecallOp> recall;
+    HexOp hex;
+    BinOp bin;
+    struct SignedOp : public Op<Display> {
+        void operator() (Display &d) { d.Signed (); }
+        std::string Help () const { return "toggle signed decimal display"; }
+    } sgn;
+    ThousandsOp thousands;
+    ViewOp view;
+    PageOp page;
+    LinesOp lines;
+    StatsOp stats;
 };
 
+// A BigNum is an unsigned integer with a fixed number of bits, enough to
+// round any Formula number correctly.  It only has the operations that
+// DecimalToDouble() needs, and throws if a result does not fit.
+class BigNum
+{
+    public:
+    static constexpr size_t LIMBS = 64;
+    static constexpr size_t BITS = 32 * LIMBS;
+    constexpr BigNum (uint32_t x = 0) : limb () { limb[0] = x; }
+    // this = this * m + a
+    constexpr void MulAdd (uint32_t m, uint32_t a)
+    {
+        uint64_t carry = a;
+        for (size_t i = 0; i < LIMBS; ++i)
+        {
+            const uint64_t t = uint64_t (limb[i]) * m + carry;
+            limb[i] = static_cast<uint32_t> (t);
+            carry = t >> 32;
+        }
+        if (carry)
+            throw std::runtime_error ("Formula number is too long");
+    }
+    constexpr void ShiftLeft (size_t n)
+    {
+        if (n == 0)
+            return;
+        if (Bits () + n > BITS)
+            throw std::runtime_error ("Formula number is too long");
+        const size_t w = n / 32;
+        const size_t b = n % 32;
+        for (size_t i = LIMBS; i-- > 0; )
+        {
+            uint32_t x = 0;
+            if (i >= w)
+                x = limb[i - w] << b;
+            if (b != 0 && i > w)
+                x |= limb[i - w - 1] >> (32 - b);
+            limb[i] = x;
+        }
+    }
+    // this = this - x, where x <= this
+    constexpr void Subtract (const BigNum &x)
+    {
+        uint64_t borrow = 0;
+        for (size_t i = 0; i < LIMBS; ++i)
+        {
+            const uint64_t t = uint64_t (limb[i]) - x.limb[i] - borrow;
+            limb[i] = static_cast<uint32_t> (t);
+            borrow = (t >> 32) & 1;
+        }
+    }
+    constexpr int Compare (const BigNum &x) const
+    {
+        for (size_t i = LIMBS; i-- > 0; )
+            if (limb[i] != x.limb[i])
+                return limb[i] < x.limb[i] ? -1 : 1;
+        return 0;
+    }
+    // The number of significant bits
+    constexpr size_t Bits () const
+    {
+        for (size_t i = LIMBS; i-- > 0; )
+        {
+            size_t n = 32 * i;
+            for (uint32_t x = limb[i]; x; x >>= 1)
+                ++n;
+            if (limb[i])
+                return n;
+        }
+        return 0;
+    }
+    constexpr bool Bit (size_t i) const
+    {
+        return i < BITS && ((limb[i / 32] >> (i % 32)) & 1);
+    }
+    private:
+    uint32_t limb[LIMBS];
+};
+
+// Round m * 10^e to the nearest double, with ties to even, as
+// ParseDouble() does.  Like ParseDouble(), fail if the result is too big
+// for a double or is not zero but rounds to zero.
+//
+// 'digits' is the number of decimal digits in m, at most 200.
+constexpr double DecimalToDouble (const BigNum &m, size_t digits, int e)
+{
+    if (m.Bits () == 0)
+        return 0.0;
+    // m * 10^e is at least 10^(digits + e - 1) and less than 10^(digits + e)
+    if (digits > 200)
+        throw std::runtime_error ("Formula number has too many digits");
+    if (static_cast<int> (digits) + e - 1 > 308 || static_cast<int> (digits) + e < -324)
+        throw std::runtime_error ("Formula number is out of range");
+    // The result is q * 2^k, with q < 2^53
+    const uint64_t ONE = 1;
+    uint64_t q = 0;
+    int k = 0;
+    if (e >= 0)
+    {
+        BigNum n = m;
+        for (int i = 0; i < e; ++i)
+            n.MulAdd (10, 0);
+        const size_t bits = n.Bits ();
+        const size_t shift = bits > 53 ? bits - 53 : 0;
+        for (size_t i = 0; i < 53; ++i)
+            q |= uint64_t (n.Bit (shift + i)) << i;
+        if (shift != 0 && n.Bit (shift - 1))
+        {
+            // At least half way to the next one
+            bool odd = q & 1;
+            for (size_t i = 0; i + 1 < shift && !odd; ++i)
+                odd = n.Bit (i);
+            if (odd)
+                ++q;
+        }
+        k = static_cast<int> (shift);
+    }
+    else
+    {
+        BigNum d (1);
+        for (int i = 0; i < -e; ++i)
+            d.MulAdd (10, 0);
+        // Start with q in [2^52, 2^54), and fewer bits for subnormals
+        k = static_cast<int> (m.Bits ()) - static_cast<int> (d.Bits ()) - 53;
+        BigNum r;
+        while (true)
+        {
+            if (k < -1074)
+                k = -1074;
+            BigNum b = d;
+            r = m;
+            if (k < 0)
+                r.ShiftLeft (-k);
+            else
+                b.ShiftLeft (k);
+            // Long division, one bit at a time
+            q = 0;
+            for (int i = 54; i >= 0; --i)
+            {
+                BigNum t = b;
+                t.ShiftLeft (i);
+                if (r.Compare (t) >= 0)
+                {
+                    r.Subtract (t);
+                    q |= ONE << i;
+                }
+            }
+            if (q < (ONE << 53))
+                break;
+            ++k;
+        }
+        // Compare the remainder to half of the divisor
+        BigNum b = d;
+        if (k > 0)
+            b.ShiftLeft (k);
+        r.ShiftLeft (1);
+        const int c = r.Compare (b);
+        if (c > 0 || (c == 0 && (q & 1)))
+            ++q;
+    }
+    if (q == (ONE << 53))
+    {
+        q >>= 1;
+        ++k;
+    }
+    if (q == 0 || k > 971)
+        throw std::runtime_error ("Formula number is out of range");
+    // Both of these are exact
+    double p = 1.0;
+    for (; k > 0; --k)
+        p *= 2.0;
+    for (; k < 0; ++k)
+        p *= 0.5;
+    return static_cast<double> (q) * p;
+}
+
+// A FormulaStack has the same semantics as a Stack, but it has a fixed
+// capacity so that it can be used in constant expressions.
+template<size_t N>
+class FormulaStack
+{
+    public:
+    constexpr FormulaStack () : stack (), size (0), reg (0.0) { }
+    constexpr size_t Size () const { return size; }
+    constexpr bool Empty () const { return size == 0; }
+    constexpr void Push (double x)
+    {
+        if (size == N)
+            throw std::runtime_error ("Formula stack overflow");
+        stack[size++] = x;
+    }
+    constexpr double Pop () { return Empty () ? 0.0 : stack[--size]; }
+    constexpr double Top () const { return Empty () ? 0.0 : stack[size - 1]; }
+    constexpr void Clear () { size = 0; }
+    constexpr double Get (size_t i) const { return stack[i]; }
+    template<typename F>
+    constexpr void ForEach (F f) const
+    {
+        for (size_t i = 0; i < size; ++i)
+            f (stack[i]);
+    }
+    constexpr double GetReg () const { return reg; }
+    constexpr void SetReg (double x) { reg = x; }
+    private:
+    double stack[N];
+    size_t size;
+    double reg;
+};
+
+// The operators that can appear in a Formula
+enum FormulaOp
+{
+    F_NUMBER, F_ARG,
+    F_PLUS, F_MINUS, F_TIMES, F_DIVIDES, F_PI,
+    F_POW, F_LOG10, F_LOG, F_EXP, F_CLEAR, F_SQRT,
+    F_SIN, F_ASIN, F_COS, F_ACOS, F_TAN, F_ATAN,
+    F_INV, F_SWAP, F_STORE, F_RECALL, F_DUP, F_CHS, F_CLX,
+    F_LG, F_NOOP, F_SUM, F_COUNT, F_MIN, F_MAX, F_MEAN, F_VAR,
+    F_DEG, F_RAD
+};
+
+struct FormulaOpName
+{
+    const char *name;
+    FormulaOp op;
+};
+
+// These have the same names and meanings as the SuperCalc operators
+constexpr FormulaOpName FORMULA_OPS[] =
+{
+    { "+", F_PLUS }, { "-", F_MINUS }, { "*", F_TIMES }, { "/", F_DIVIDES },
+    { "pi", F_PI }, { "pow", F_POW }, { "log", F_LOG10 }, { "ln", F_LOG },
+    { "exp", F_EXP }, { "clr", F_CLEAR }, { "sqrt", F_SQRT },
+    { "sin", F_SIN }, { "asin", F_ASIN }, { "cos", F_COS },
+    { "acos", F_ACOS }, { "tan", F_TAN }, { "atan", F_ATAN },
+    { "inv", F_INV }, { "swap", F_SWAP }, { "sto", F_STORE },
+    { "rcl", F_RECALL }, { "dup", F_DUP }, { "chs", F_CHS },
+    { "clx", F_CLX }, { "lg", F_LG }, { "noop", F_NOOP }, { "sum", F_SUM },
+    { "count", F_COUNT }, { "min", F_MIN }, { "max", F_MAX },
+    { "mean", F_MEAN }, { "var", F_VAR }, { "deg", F_DEG }, { "rad", F_RAD }
+};
+
+struct FormulaInstruction
+{
+    FormulaOp op = F_NOOP;
+    double value = 0.0;
+    size_t arg = 0;
+};
+
+// A Formula is an RPN string that is parsed when the Formula is
+// constructed, which happens at compile time when it is constexpr.
+//
+//      constexpr auto f = Compile ("$1 $2 + 2 /");
+//      static_assert (f (1.0, 3.0) == 2.0, "");
+//      double y = f (a, b);
+//
+// The tokens '$1', '$2', ... refer to the arguments.  Other tokens are
+// numbers or SuperCalc operators, with the same semantics as SuperCalc.
+// Evaluation uses a switch instead of virtual calls and map lookups.
+// See Inline() for expanding a Formula into straight line code.
+//
+// Numbers are rounded to the nearest double, as the calculator does, and
+// can have up to 200 significant digits.  The transcendental operators
+// can only be evaluated at compile time if the compiler's <cmath> is
+// constexpr, as with gcc.
+template<size_t N>
+class Formula
+{
+    public:
+    constexpr Formula (const char (&str)[N]) :
+        code (),
+        size (0)
+    {
+        size_t i = 0;
+        while (true)
+        {
+            while (i < N && IsSpace (str[i]))
+                ++i;
+            if (i == N || str[i] == '\0')
+                break;
+            size_t j = i;
+            while (j < N && str[j] != '\0' && !IsSpace (str[j]))
+                ++j;
+            code[size++] = ParseToken (str + i, j - i);
+            i = j;
+        }
+    }
+    template<typename... Args>
+    constexpr double operator() (Args... args) const
+    {
+        const double argv[sizeof... (Args) + 1] = { static_cast<double> (args)... };
+        StackType s;
+        for (size_t i = 0; i < size; ++i)
+        {
+            const FormulaInstruction &c = code[i];
+            if (c.op == F_ARG)
+            {
+                if (c.arg >= sizeof... (Args))
+                    throw std::runtime_error ("Missing formula argument");
+                s.Push (argv[c.arg]);
+            }
+            else
+                Exec (c.op, c.value, s);
+        }
+        return s.Top ();
+    }
+    typedef FormulaStack<N> StackType;
+    constexpr size_t Size () const { return size; }
+    constexpr FormulaInstruction Code (size_t i) const { return code[i]; }
+    // Execute one operator.  OP is a template argument so that each
+    // operator inlines on its own.
+    template<FormulaOp OP>
+    static constexpr void Exec (double value, StackType &s)
+    {
+        switch (OP)
+        {
+            case F_NUMBER: s.Push (value); break;
+            case F_PLUS: BasicCalc::PlusOp::Exec (s); break;
+            case F_MINUS: BasicCalc::MinusOp::Exec (s); break;
+            case F_TIMES: BasicCalc::TimesOp::Exec (s); break;
+            case F_DIVIDES: BasicCalc::DividesOp::Exec (s); break;
+            case F_PI: BasicCalc::PiOp::Exec (s); break;
+            case F_POW: HP35::PowOp::Exec (s); break;
+            case F_LOG10: HP35::Log10Op::Exec (s); break;
+            case F_LOG: HP35::LogOp::Exec (s); break;
+            case F_EXP: HP35::ExpOp::Exec (s); break;
+            case F_CLEAR: HP35::ClearOp::Exec (s); break;
+            case F_SQRT: HP35::SqrtOp::Exec (s); break;
+            case F_SIN: HP35::SinOp::Exec (s); break;
+            case F_ASIN: HP35::ArcSinOp::Exec (s); break;
+            case F_COS: HP35::CosOp::Exec (s); break;
+            case F_ACOS: HP35::ArcCosOp::Exec (s); break;
+            case F_TAN: HP35::TanOp::Exec (s); break;
+            case F_ATAN: HP35::ArcTanOp::Exec (s); break;
+            case F_INV: HP35::InvOp::Exec (s); break;
+            case F_SWAP: HP35::SwapOp::Exec (s); break;
+            case F_STORE: HP35::StoreOp::Exec (s); break;
+            case F_RECALL: HP35::RecallOp::Exec (s); break;
+            case F_DUP: HP35::DupOp::Exec (s); break;
+            case F_CHS: HP35::ChsOp::Exec (s); break;
+            case F_CLX: HP35::ClxOp::Exec (s); break;
+            case F_LG: SuperCalc::LgOp::Exec (s); break;
+            case F_NOOP: SuperCalc::NoOp::Exec (s); break;
+            case F_SUM: SuperCalc::SumOp::Exec (s); break;
+            case F_COUNT: SuperCalc::CountOp::Exec (s); break;
+            case F_MIN: SuperCalc::MinOp::Exec (s); break;
+            case F_MAX: SuperCalc::MaxOp::Exec (s); break;
+            case F_MEAN: SuperCalc::MeanOp::Exec (s); break;
+            case F_VAR: SuperCalc::VarOp::Exec (s); break;
+            case F_DEG: SuperCalc::DegOp::Exec (s); break;
+            case F_RAD: SuperCalc::RadOp::Exec (s); break;
+            case F_ARG: break;
+        }
+    }
+    private:
+    static constexpr bool IsSpace (char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+    static constexpr bool IsDigit (char c) { return c >= '0' && c <= '9'; }
+    static constexpr FormulaInstruction ParseToken (const char *p, size_t n)
+    {
+        FormulaInstruction c;
+        if (p[0] == '$')
+        {
+            if (n < 2)
+                throw std::runtime_error ("Invalid formula argument");
+            size_t k = 0;
+            for (size_t i = 1; i < n; ++i)
+            {
+                if (!IsDigit (p[i]))
+                    throw std::runtime_error ("Invalid formula argument");
+                k = k * 10 + (p[i] - '0');
+            }
+            if (k == 0)
+                throw std::runtime_error ("Invalid formula argument");
+            c.op = F_ARG;
+            c.arg = k - 1;
+            return c;
+        }
+        if (IsDigit (p[0]) || ((p[0] == '-' || p[0] == '+' || p[0] == '.') && n > 1))
+        {
+            c.op = F_NUMBER;
+            c.value = ParseNumber (p, n);
+            return c;
+        }
+        for (const FormulaOpName &f : FORMULA_OPS)
+        {
+            size_t i = 0;
+            while (i < n && f.name[i] == p[i])
+                ++i;
+            if (i == n && f.name[i] == '\0')
+            {
+                c.op = f.op;
+                return c;
+            }
+        }
+        throw std::runtime_error ("Invalid formula operator");
+    }
+    static constexpr double ParseNumber (const char *p, size_t n)
+    {
+        size_t i = 0;
+        bool neg = false;
+        if (p[i] == '-' || p[i] == '+')
+            neg = p[i++] == '-';
+        // Accumulate the significant digits as an integer.  Zeros are
+        // only added when a nonzero digit follows them.
+        BigNum m;
+        size_t digits = 0;
+        size_t zeros = 0;
+        int exp = 0;
+        bool any = false;
+        bool point = false;
+        for (; i < n && (IsDigit (p[i]) || (p[i] == '.' && !point)); ++i)
+        {
+            if (p[i] == '.')
+            {
+                point = true;
+                continue;
+            }
+            any = true;
+            if (point)
+                --exp;
+            if (p[i] == '0')
+            {
+                zeros += digits != 0;
+                continue;
+            }
+            if (digits + zeros >= 200)
+                throw std::runtime_error ("Formula number has too many digits");
+            for (; zeros != 0; --zeros, ++digits)
+                m.MulAdd (10, 0);
+            m.MulAdd (10, p[i] - '0');
+            ++digits;
+        }
+        if (!any)
+            throw std::runtime_error ("Invalid formula number");
+        exp += static_cast<int> (zeros);
+        if (i < n && (p[i] == 'e' || p[i] == 'E'))
+        {
+            ++i;
+            bool eneg = false;
+            if (i < n && (p[i] == '-' || p[i] == '+'))
+                eneg = p[i++] == '-';
+            if (i == n)
+                throw std::runtime_error ("Invalid formula number");
+            int e = 0;
+            for (; i < n && IsDigit (p[i]); ++i)
+                if (e < 100000)
+                    e = e * 10 + (p[i] - '0');
+            exp += eneg ? -e : e;
+        }
+        if (i != n)
+            throw std::runtime_error ("Invalid formula number");
+        const double x = DecimalToDouble (m, digits, exp);
+        return neg ? -x : x;
+    }
+    private:
+    static constexpr void Exec (FormulaOp op, double value, StackType &s)
+    {
+        switch (op)
+        {
+            case F_NUMBER: Exec<F_NUMBER> (value, s); break;
+            case F_PLUS: Exec<F_PLUS> (value, s); break;
+            case F_MINUS: Exec<F_MINUS> (value, s); break;
+            case F_TIMES: Exec<F_TIMES> (value, s); break;
+            case F_DIVIDES: Exec<F_DIVIDES> (value, s); break;
+            case F_PI: Exec<F_PI> (value, s); break;
+            case F_POW: Exec<F_POW> (value, s); break;
+            case F_LOG10: Exec<F_LOG10> (value, s); break;
+            case F_LOG: Exec<F_LOG> (value, s); break;
+            case F_EXP: Exec<F_EXP> (value, s); break;
+            case F_CLEAR: Exec<F_CLEAR> (value, s); break;
+            case F_SQRT: Exec<F_SQRT> (value, s); break;
+            case F_SIN: Exec<F_SIN> (value, s); break;
+            case F_ASIN: Exec<F_ASIN> (value, s); break;
+            case F_COS: Exec<F_COS> (value, s); break;
+            case F_ACOS: Exec<F_ACOS> (value, s); break;
+            case F_TAN: Exec<F_TAN> (value, s); break;
+            case F_ATAN: Exec<F_ATAN> (value, s); break;
+            case F_INV: Exec<F_INV> (value, s); break;
+            case F_SWAP: Exec<F_SWAP> (value, s); break;
+            case F_STORE: Exec<F_STORE> (value, s); break;
+            case F_RECALL: Exec<F_RECALL> (value, s); break;
+            case F_DUP: Exec<F_DUP> (value, s); break;
+            case F_CHS: Exec<F_CHS> (value, s); break;
+            case F_CLX: Exec<F_CLX> (value, s); break;
+            case F_LG: Exec<F_LG> (value, s); break;
+            case F_NOOP: Exec<F_NOOP> (value, s); break;
+            case F_SUM: Exec<F_SUM> (value, s); break;
+            case F_COUNT: Exec<F_COUNT> (value, s); break;
+            case F_MIN: Exec<F_MIN> (value, s); break;
+            case F_MAX: Exec<F_MAX> (value, s); break;
+            case F_MEAN: Exec<F_MEAN> (value, s); break;
+            case F_VAR: Exec<F_VAR> (value, s); break;
+            case F_DEG: Exec<F_DEG> (value, s); break;
+            case F_RAD: Exec<F_RAD> (value, s); break;
+            case F_ARG: break;
+        }
+    }
+    FormulaInstruction code[N];
+    size_t size;
+};
+
+template<size_t N>
+constexpr Formula<N> Compile (const char (&str)[N])
+{
+    return Formula<N> (str);
+}
+
+// Evaluate an RPN string, at compile time if the arguments are constant
+template<size_t N, typename... Args>
+constexpr double Evaluate (const char (&str)[N], Args... args)
+{
+    return Formula<N> (str) (args...);
+}
+
+template<const auto &F, size_t I>
+inline void InlineStep (typename std::decay<decltype (F)>::type::StackType &s,
+    const double *argv, size_t argc)
+{
+    constexpr FormulaInstruction c = F.Code (I);
+    if constexpr (c.op == F_ARG)
+    {
+        if (c.arg >= argc)
+            throw std::runtime_error ("Missing formula argument");
+        s.Push (argv[c.arg]);
+    }
+    else
+        F.template Exec<c.op> (c.value, s);
+}
+
+template<const auto &F, size_t... I, typename... Args>
+inline double InlineSteps (std::index_sequence<I...>, Args... args)
+{
+    const double argv[sizeof... (Args) + 1] = { static_cast<double> (args)... };
+    typename std::decay<decltype (F)>::type::StackType s;
+    (InlineStep<F,I> (s, argv, sizeof... (Args)), ...);
+    return s.Top ();
+}
+
+// Evaluate a Formula with static storage duration, expanding each of its
+// instructions in line.
+//
+//      static constexpr auto f = Compile ("$1 $2 + 2 /");
+//      double y = Inline<f> (a, b);
+//
+// Unlike calling the Formula directly, this does not rely on the
+// optimizer to unroll the evaluation loop.
+template<const auto &F, typename... Args>
+inline double Inline (Args... args)
+{
+    return InlineSteps<F> (std::make_index_sequence<F.Size ()> (), args...);
+}
+
 } // namespace jsp
 
 #endif // RPN_H
@@ -0,0 +1,223 @@
+// Sharded batch reductions
+//
+// Copyright (C) 2007
+// Center for Perceptual Systems
+// University of Texas at Austin
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "rpn.h"
+#include <cerrno>
+#include <cstdio>
+#include <cctype>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <limits>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace jsp
+{
+
+// Compute the Moments of the numbers in a file that start in the byte
+// range [begin, end).
+//
+// A number that straddles 'begin' belongs to the previous range, so
+// adjacent ranges see each number exactly once.
+inline Moments ReduceRange (const std::string &fn, off_t begin, off_t end)
+{
+    FILE *fp = std::fopen (fn.c_str (), "rb");
+    if (!fp)
+        throw std::runtime_error ("Could not open " + fn);
+    Moments m;
+    std::string token;
+    try
+    {
+        off_t pos = begin;
+        int c = EOF;
+        if (begin > 0)
+        {
+            // Skip the tail of a number started in the previous range
+            if (fseeko (fp, begin - 1, SEEK_SET) != 0)
+                throw std::runtime_error ("Could not seek in " + fn);
+            c = std::getc (fp);
+            if (c != EOF && !std::isspace (c))
+            {
+                while ((c = std::getc (fp)) != EOF && !std::isspace (c))
+                    ++pos;
+            }
+            else
+                c = std::getc (fp);
+        }
+        else
+            c = std::getc (fp);
+        while (true)
+        {
+            // Skip whitespace
+            while (c != EOF && std::isspace (c))
+            {
+                ++pos;
+                c = std::getc (fp);
+            }
+            if (c == EOF || pos >= end)
+                break;
+            // Read a number
+            token.clear ();
+            while (c != EOF && !std::isspace (c))
+            {
+                token += static_cast<char> (c);
+                ++pos;
+                c = std::getc (fp);
+            }
+            // Accept the same numbers as the calculator
+            double x;
+            if (!ParseDouble (token, x))
+                throw std::runtime_error ("Invalid number: " + token);
+            m.Add (x);
+        }
+    }
+    catch (...)
+    {
+        std::fclose (fp);
+        throw;
+    }
+    std::fclose (fp);
+    return m;
+}
+
+// Kill and reap workers that will not be collected, and close their pipes
+inline void StopWorkers (const std::vector<pid_t> &pids, const std::vector<int> &fds)
+{
+    for (size_t i = 0; i < pids.size (); ++i)
+    {
+        close (fds[i]);
+        kill (pids[i], SIGKILL);
+        int status;
+        while (waitpid (pids[i], &status, 0) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+// Split a file into byte range shards, compute the Moments of each shard
+// in its own process, and merge them.
+//
+// A pipe or a terminal can't be split, so it is reduced in a single pass
+// in this process instead.  Anything else that is not a regular file is
+// an error.
+//
+// Each worker sends its partial state back over a pipe in the format
+// written by Moments::Serialize(), or a line starting with "error".
+// Partial states are merged in shard order, so the result does not
+// depend on which worker finishes first.
+inline Moments ReduceShards (const std::string &fn, size_t shards)
+{
+    if (shards == 0)
+        throw std::runtime_error ("The number of shards must be positive");
+    struct stat st;
+    if (stat (fn.c_str (), &st) != 0)
+        throw std::runtime_error ("Could not open " + fn);
+    if (S_ISFIFO (st.st_mode) || S_ISCHR (st.st_mode))
+        return ReduceRange (fn, 0, std::numeric_limits<off_t>::max ());
+    if (!S_ISREG (st.st_mode))
+        throw std::runtime_error (fn + " is not a regular file");
+    FILE *fp = std::fopen (fn.c_str (), "rb");
+    if (!fp)
+        throw std::runtime_error ("Could not open " + fn);
+    const off_t size = fseeko (fp, 0, SEEK_END) == 0 ? ftello (fp) : -1;
+    std::fclose (fp);
+    if (size < 0)
+        throw std::runtime_error ("Could not seek in " + fn);
+
+    // Don't let the workers flush our buffers a second time
+    std::cout.flush ();
+    std::cerr.flush ();
+
+    std::vector<pid_t> pids;
+    std::vector<int> fds;
+    for (size_t i = 0; i < shards; ++i)
+    {
+        const off_t begin = size * i / shards;
+        const off_t end = size * (i + 1) / shards;
+        int p[2];
+        if (pipe (p) != 0)
+        {
+            StopWorkers (pids, fds);
+            throw std::runtime_error ("Could not create pipe");
+        }
+        const pid_t pid = fork ();
+        if (pid < 0)
+        {
+            close (p[0]);
+            close (p[1]);
+            StopWorkers (pids, fds);
+            throw std::runtime_error ("Could not fork");
+        }
+        if (pid == 0)
+        {
+            close (p[0]);
+            std::string out;
+            int status = 0;
+            try
+            {
+                out = ReduceRange (fn, begin, end).Serialize ();
+            }
+            catch (const std::exception &e)
+            {
+                out = std::string ("error ") + e.what () + "\n";
+                status = 1;
+            }
+            for (size_t n = 0; n < out.size (); )
+            {
+                const ssize_t w = write (p[1], out.data () + n, out.size () - n);
+                if (w < 0 && errno != EINTR)
+                    _exit (1);
+                n += w < 0 ? 0 : w;
+            }
+            _exit (status);
+        }
+        close (p[1]);
+        pids.push_back (pid);
+        fds.push_back (p[0]);
+    }
+
+    // Collect and merge the partial states
+    Moments m;
+    std::string error;
+    for (size_t i = 0; i < shards; ++i)
+    {
+        std::string in;
+        char buf[256];
+        ssize_t r;
+        while ((r = read (fds[i], buf, sizeof (buf))) != 0)
+        {
+            if (r < 0 && errno != EINTR)
+                break;
+            if (r > 0)
+                in.append (buf, r);
+        }
+        close (fds[i]);
+        int status;
+        waitpid (pids[i], &status, 0);
+        if (!error.empty ())
+            continue;
+        if (in.compare (0, 6, "error ") == 0)
+            error = in.substr (6, in.find ('\n') - 6);
+        else if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+            error = "Worker failed";
+        else
+            m.Merge (Moments::Deserialize (in));
+    }
+    if (!error.empty ())
+        throw std::runtime_error (error);
+    return m;
+}
+
+} // namespace jsp
+
+#endif // SHARD_H
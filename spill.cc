@@ -0,0 +1,58 @@
+// Stack spill files
+//
+// Copyright (C) 2007
+// Center for Perceptual Systems
+// University of Texas at Austin
+
+#include "rpn.h"
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace jsp
+{
+
+SpillFile::~SpillFile ()
+{
+    if (fd != -1)
+        close (fd);
+}
+
+void *SpillFile::Map (size_t i, size_t bytes)
+{
+    if (fd == -1)
+    {
+        std::string d = dir;
+        if (d.empty ())
+            d = std::getenv ("TMPDIR") ? std::getenv ("TMPDIR") : "/var/tmp";
+        std::string fn = d + "/rpn_stack_XXXXXX";
+        fd = mkstemp (&fn[0]);
+        if (fd == -1)
+            throw std::runtime_error ("Could not create stack spill file in " + d);
+        // The file goes away when it is closed
+        unlink (fn.c_str ());
+    }
+    // Reserve the blocks.  Just growing the file would make it sparse,
+    // and writing to the mapping would then raise SIGBUS when the disk
+    // is full.
+    if (posix_fallocate (fd, i * bytes, bytes) != 0)
+        throw std::runtime_error ("Could not grow stack spill file");
+    void *p = mmap (0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, i * bytes);
+    if (p == MAP_FAILED)
+        throw std::runtime_error ("Could not map stack spill file");
+    madvise (p, bytes, MADV_SEQUENTIAL);
+    return p;
+}
+
+void SpillFile::Unmap (void *chunk, size_t i, size_t bytes)
+{
+    munmap (chunk, bytes);
+    // If this fails, the file is just bigger than it needs to be
+    if (ftruncate (fd, i * bytes) != 0)
+        return;
+}
+
+} // namespace jsp
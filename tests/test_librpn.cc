@@ -0,0 +1,231 @@
+// Reverse Polish Notation Calculator Library
+//
+// Copyright (C) 2007
+// Center for Perceptual Systems
+// University of Texas at Austin
+
+#include "verify.h"
+// Like curses.h, which programs that embed the calculator may include
+#define OK (0)
+#define ERR (-1)
+#include "librpn.h"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+using namespace jsp;
+
+// Saves everything written to it
+class StringSink : public Sink
+{
+    public:
+    void Write (const char *s, size_t n) { str.append (s, n); }
+    string str;
+};
+
+// Supplies one token
+class OneSource : public Source
+{
+    public:
+    OneSource (const string &token) : token (token) { }
+    bool Read (string &t)
+    {
+        if (token.empty ())
+            return false;
+        t = token;
+        token.clear ();
+        return true;
+    }
+    string token;
+};
+
+void test0 ()
+{
+    Context c;
+    Result r = c.Evaluate ("1 2 + 3 *");
+    VERIFY (r.status == EVAL_OK);
+    VERIFY (r.depth == 1);
+    VERIFY (r.value == 9.0);
+    VERIFY (r.position == 9);
+    // State carries over between calls
+    r = c.Evaluate ("  4 sum\n");
+    VERIFY (r.status == EVAL_OK);
+    VERIFY (r.value == 13.0);
+    r = c.Evaluate ("");
+    VERIFY (r.status == EVAL_OK);
+    VERIFY (r.value == 13.0);
+    VERIFY (c.GetStack ().Size () == 1);
+}
+
+void test1 ()
+{
+    // Errors are returned, not thrown
+    Context c (BASIC_MODE);
+    Result r = c.Evaluate ("1 2 sqrt 3");
+    VERIFY (r.status == EVAL_UNKNOWN_TOKEN);
+    VERIFY (r.position == 4);
+    VERIFY (r.token == "sqrt");
+    VERIFY (r.depth == 2);
+    r = c.Evaluate ("1 quit 2");
+    VERIFY (r.status == EVAL_QUIT);
+    VERIFY (r.position == 2);
+    VERIFY (r.depth == 3);
+
+    Context i (INT_MODE);
+    r = i.Evaluate ("7 1 0 / 5");
+    VERIFY (r.status == EVAL_ERROR);
+    VERIFY (r.token == "/");
+    VERIFY (r.message == "Division by zero");
+    // The operands are still there
+    VERIFY (r.depth == 3);
+    VERIFY (r.int_value == 0);
+    r = i.Evaluate ("clr 5 12 width");
+    VERIFY (r.status == EVAL_ERROR);
+    VERIFY (r.depth == 2);
+    VERIFY (r.int_value == 12);
+    i.Evaluate ("clr");
+    r = i.Evaluate ("9007199254740993 1 +");
+    VERIFY (r.status == EVAL_OK);
+    VERIFY (r.int_value == 9007199254740994ull);
+
+    // Numbers must be whole tokens
+    Context s;
+    r = s.Evaluate ("1abc");
+    VERIFY (r.status == EVAL_UNKNOWN_TOKEN);
+    r = s.Evaluate ("+5 -2.5e1 +");
+    VERIFY (r.status == EVAL_OK);
+    VERIFY (r.value == -20.0);
+    const char *special[] = { "nan", "-nan", "inf", "+inf", "-infinity", "1e999" };
+    for (const char *token : special)
+    {
+        r = s.Evaluate (token);
+        VERIFY (r.status == EVAL_UNKNOWN_TOKEN);
+        VERIFY (r.depth == 1);
+    }
+}
+
+void test2 ()
+{
+    // Output goes to the sink, if there is one
+    Context c;
+    Result r = c.Evaluate ("hex 255");
+    VERIFY (r.status == EVAL_OK);
+    StringSink sink;
+    c.SetSink (&sink);
+    c.Show ();
+    VERIFY (sink.str == "255.000000\tFF\n");
+    sink.str.clear ();
+    c.SetShowStack (true);
+    r = c.Evaluate (", prec 2 1234567.126");
+    VERIFY (r.status == EVAL_OK);
+    VERIFY (sink.str.find ("1,234,567.13\t12D687\n") != string::npos);
+    sink.str.clear ();
+    c.Help ();
+    VERIFY (sink.str.find ("sum\tsum all numbers on the stack\n") != string::npos);
+
+    // The precision comes from the source when the string runs out
+    Context d;
+    OneSource source ("1");
+    d.SetSource (&source);
+    d.SetSink (&sink);
+    r = d.Evaluate ("prec");
+    VERIFY (r.status == EVAL_OK);
+    sink.str.clear ();
+    d.Evaluate ("2.25");
+    d.Show ();
+    VERIFY (sink.str == "2.2\n");
+    r = d.Evaluate ("prec");
+    VERIFY (r.status == EVAL_ERROR);
+    r = d.Evaluate ("prec x");
+    VERIFY (r.status == EVAL_ERROR);
+
+    // Display commands can be ignored, but they still take their
+    // arguments
+    Context e;
+    e.SetDisplayEnabled (false);
+    e.SetSink (&sink);
+    sink.str.clear ();
+    r = e.Evaluate ("prec 3 lines 2 1.23456");
+    VERIFY (r.status == EVAL_OK);
+    VERIFY (r.depth == 1);
+    e.Show ();
+    VERIFY (sink.str == "1.234560\n");
+    r = e.Evaluate ("prec x");
+    VERIFY (r.status == EVAL_ERROR);
+    VERIFY (r.depth == 1);
+}
+
+void test3 ()
+{
+    // Only the top of the stack is shown
+    Context c;
+    StringSink sink;
+    c.SetSink (&sink);
+    c.Evaluate ("prec 0 lines 3 1 2 3 4 5");
+    sink.str.clear ();
+    c.Show ();
+    VERIFY (sink.str == "-- depth 5, levels 1-3\n3\n4\n5\n");
+    sink.str.clear ();
+    c.Evaluate ("page");
+    c.Show ();
+    VERIFY (sink.str == "-- depth 5, levels 4-5\n1\n2\n");
+    // Can't scroll past the bottom
+    sink.str.clear ();
+    c.Evaluate ("page page");
+    c.Show ();
+    VERIFY (sink.str == "-- depth 5, levels 4-5\n1\n2\n");
+    sink.str.clear ();
+    c.Evaluate ("view stats");
+    sink.str.clear ();
+    c.Show ();
+    VERIFY (sink.str == "-- depth 5, levels 1-3, min 1, max 5, sum 15\n3\n4\n5\n");
+    // Changing the stack scrolls back to the top
+    c.Evaluate ("page +");
+    sink.str.clear ();
+    c.Show ();
+    VERIFY (sink.str == "-- depth 4, levels 1-3, min 1, max 9, sum 15\n2\n3\n9\n");
+    c.Evaluate ("stats clr");
+    sink.str.clear ();
+    c.Show ();
+    VERIFY (sink.str.empty ());
+
+    Context i (INT_MODE);
+    i.SetSink (&sink);
+    i.Evaluate ("8 width 200 100 stats");
+    sink.str.clear ();
+    i.Show ();
+    VERIFY (sink.str == "-- depth 2, levels 1-2, min 100, max 200, sum 44\n200\n100\n");
+    // Signed stats compare signed values
+    i.Evaluate ("sgn");
+    sink.str.clear ();
+    i.Show ();
+    VERIFY (sink.str == "-- depth 2, levels 1-2, min -56, max 100, sum 44\n-56\n100\n");
+
+    // The stats sum matches the sum op
+    c.Evaluate ("clr 1e16 1 -1e16 stats");
+    sink.str.clear ();
+    c.Show ();
+    VERIFY (sink.str == "-- depth 3, levels 1-3, min -10000000000000000, max 10000000000000000, sum 1\n10000000000000000\n1\n-10000000000000000\n");
+    c.Evaluate ("sum");
+    VERIFY (c.GetStack ().Top () == 1.0);
+}
+
+int main ()
+{
+    try
+    {
+        test0 ();
+        test1 ();
+        test2 ();
+        test3 ();
+
+        cerr << "Success" << endl;
+        return 0;
+    }
+    catch (const exception &e)
+    {
+        cerr << e.what () << endl;
+        return -1;
+    }
+}
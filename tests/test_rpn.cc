@@ -8,7 +8,12 @@
 
 #include "verify.h"
 #include "rpn.h"
+#include "shard.h"
+#include "trace.h"
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 
 using namespace std;
@@ -167,6 +172,713 @@ void test3 ()
     VERIFY (AboutEqual(s.Pop (), 90.0));
 }
 
+void test4 ()
+{
+    IntStack s;
+    Display d;
+    IntCalc c;
+
+    uint64_t x = 0;
+    VERIFY (ParseInt ("0x10", x) && x == 16);
+    VERIFY (ParseInt ("0b101", x) && x == 5);
+    VERIFY (ParseInt ("-1", x) && x == ~uint64_t (0));
+    VERIFY (ParseInt ("18446744073709551615", x) && x == ~uint64_t (0));
+    VERIFY (!ParseInt ("18446744073709551616", x));
+    VERIFY (!ParseInt ("1.5", x));
+    VERIFY (!ParseInt ("and", x));
+
+    // Exact above 2^53
+    s.Push (9007199254740993ull);
+    s.Push (1);
+    c.Exec ("+", s, d);
+    VERIFY (s.Pop () == 9007199254740994ull);
+    s.Push (0xF0);
+    s.Push (0x3C);
+    c.Exec ("and", s, d);
+    VERIFY (s.Pop () == 0x30);
+    s.Push (0xF0);
+    s.Push (0x0F);
+    c.Exec ("or", s, d);
+    VERIFY (s.Pop () == 0xFF);
+    s.Push (0xFF);
+    s.Push (0x0F);
+    c.Exec ("xor", s, d);
+    VERIFY (s.Pop () == 0xF0);
+    s.Push (0);
+    c.Exec ("not", s, d);
+    VERIFY (s.Pop () == ~uint64_t (0));
+    s.Push (1);
+    s.Push (63);
+    c.Exec ("shl", s, d);
+    VERIFY (s.Pop () == uint64_t (1) << 63);
+    s.Push (1);
+    s.Push (64);
+    c.Exec ("shl", s, d);
+    VERIFY (s.Pop () == 0);
+    s.Push (0x80);
+    s.Push (7);
+    c.Exec ("shr", s, d);
+    VERIFY (s.Pop () == 1);
+    s.Push (uint64_t (1) << 63);
+    s.Push (1);
+    c.Exec ("rol", s, d);
+    VERIFY (s.Pop () == 1);
+    s.Push (1);
+    s.Push (1);
+    c.Exec ("ror", s, d);
+    VERIFY (s.Pop () == uint64_t (1) << 63);
+    s.Push (0xF0F0);
+    c.Exec ("popcnt", s, d);
+    VERIFY (s.Pop () == 8);
+    s.Push (1);
+    c.Exec ("clz", s, d);
+    VERIFY (s.Pop () == 63);
+    s.Push (0x100);
+    c.Exec ("ctz", s, d);
+    VERIFY (s.Pop () == 8);
+    s.Push (0);
+    c.Exec ("ctz", s, d);
+    VERIFY (s.Pop () == 64);
+    s.Push (0x0102030405060708ull);
+    c.Exec ("bswap", s, d);
+    VERIFY (s.Pop () == 0x0807060504030201ull);
+    s.Push (0x5);
+    s.Push (0xF0);
+    c.Exec ("pdep", s, d);
+    VERIFY (s.Pop () == 0x50);
+    s.Push (0x5A);
+    s.Push (0xF0);
+    c.Exec ("pext", s, d);
+    VERIFY (s.Pop () == 0x5);
+    // The intrinsics and the fallbacks must agree.  The fallbacks are
+    // called directly, because the dispatch skips them on CPUs with BMI2.
+    uint64_t y = 0x123456789ABCDEF1ull;
+    for (int i = 0; i < 1000; ++i)
+    {
+        y ^= y << 13;
+        y ^= y >> 7;
+        y ^= y << 17;
+        uint64_t z = 0, m = y * 0x9E3779B97F4A7C15ull;
+        if (i == 0 || i == 1)
+            m = i == 0 ? 0 : ~uint64_t (0);
+        for (int j = 0, k = 0; j < 64; ++j)
+            if ((m >> j) & 1)
+                z |= ((y >> k++) & 1) << j;
+        const uint64_t low = PopCount64 (m) == 64 ? y : y & ((uint64_t (1) << PopCount64 (m)) - 1);
+        VERIFY (DepositBits64Portable (y, m) == z);
+        VERIFY (ExtractBits64Portable (z, m) == low);
+        VERIFY (DepositBits64 (y, m) == z);
+        VERIFY (ExtractBits64 (z, m) == low);
+    }
+
+    // Narrow widths
+    s.Push (8);
+    c.Exec ("width", s, d);
+    VERIFY (s.Width () == 8);
+    s.Push (0x1FF);
+    VERIFY (s.Pop () == 0xFF);
+    s.Push (0x81);
+    s.Push (1);
+    c.Exec ("rol", s, d);
+    VERIFY (s.Pop () == 0x03);
+    s.Push (1);
+    c.Exec ("clz", s, d);
+    VERIFY (s.Pop () == 7);
+    s.Push (0xAB);
+    c.Exec ("bswap", s, d);
+    VERIFY (s.Pop () == 0xAB);
+    s.Push (0x80);
+    s.Push (3);
+    c.Exec ("sar", s, d);
+    VERIFY (s.Pop () == 0xF0);
+    s.Push (1);
+    c.Exec ("chs", s, d);
+    VERIFY (s.Pop () == 0xFF);
+    s.Push (16);
+    c.Exec ("width", s, d);
+    s.Push (0x1234);
+    c.Exec ("bswap", s, d);
+    VERIFY (s.Pop () == 0x3412);
+    s.Push (64);
+    c.Exec ("width", s, d);
+    // Failures leave the stack alone
+    s.Clear ();
+    s.Push (5);
+    s.Push (12);
+    bool thrown = false;
+    try { c.Exec ("width", s, d); }
+    catch (const runtime_error &) { thrown = true; }
+    VERIFY (thrown);
+    VERIFY (s.Size () == 2);
+    VERIFY (s.Top () == 12);
+    VERIFY (s.Width () == 64);
+    s.Push (1);
+    s.Push (0);
+    thrown = false;
+    try { c.Exec ("/", s, d); }
+    catch (const runtime_error &) { thrown = true; }
+    VERIFY (thrown);
+    VERIFY (s.Size () == 4);
+    VERIFY (s.Top () == 0);
+    thrown = false;
+    try { c.Exec ("%", s, d); }
+    catch (const runtime_error &) { thrown = true; }
+    VERIFY (thrown);
+    VERIFY (s.Size () == 4);
+}
+
+void test5 ()
+{
+    const char *fn = "test_rpn.trc";
+    {
+        TraceWriter w (fn, 's');
+        TraceEntry e;
+        e.token = "1";
+        e.usecs = 0;
+        e.checksum = TraceChecksum (1, 1.0);
+        w.Write (e);
+        e.token = std::string (200, 'x');
+        e.usecs = 1ull << 40;
+        e.checksum = 0xDEADBEEF;
+        w.Write (e);
+    }
+    {
+        TraceReader r (fn);
+        VERIFY (r.Mode () == 's');
+        TraceEntry e;
+        VERIFY (r.Read (e));
+        VERIFY (e.token == "1");
+        VERIFY (e.usecs == 0);
+        VERIFY (e.checksum == TraceChecksum (1, 1.0));
+        VERIFY (r.Read (e));
+        VERIFY (e.token == std::string (200, 'x'));
+        VERIFY (e.usecs == 1ull << 40);
+        VERIFY (e.checksum == 0xDEADBEEF);
+        VERIFY (!r.Read (e));
+    }
+    // A corrupt token length fails instead of allocating
+    {
+        std::ofstream ofs (fn, std::ios::binary);
+        ofs.write (TRACE_MAGIC, sizeof (TRACE_MAGIC));
+        ofs.put (TRACE_VERSION);
+        ofs.put ('s');
+        ofs.write ("\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x7F", 8);
+    }
+    {
+        TraceReader r (fn);
+        TraceEntry e;
+        bool thrown = false;
+        try { r.Read (e); }
+        catch (const runtime_error &) { thrown = true; }
+        VERIFY (thrown);
+    }
+    VERIFY (TraceChecksum (1, 1.0) != TraceChecksum (2, 1.0));
+    VERIFY (TraceChecksum (1, 1.0) != TraceChecksum (1, 2.0));
+
+    // A recorded session replays cleanly, and a changed stack doesn't
+    const char *session[] = { "1", "2", "+", "prec 3", "dup", "*" };
+    const size_t N = sizeof (session) / sizeof (session[0]);
+    for (size_t bad = 0; bad <= N; ++bad)
+    {
+        {
+            Context c;
+            TraceWriter w (fn, c.Mode ());
+            for (size_t i = 0; i < N; ++i)
+            {
+                c.Evaluate (session[i]);
+                TraceEntry e;
+                e.token = session[i];
+                e.usecs = 10;
+                e.checksum = TraceChecksum (c) ^ (i == bad);
+                w.Write (e);
+            }
+        }
+        Context c;
+        TraceReader r (fn);
+        if (bad == N)
+        {
+            const ReplayStats stats = Replay (c, r);
+            VERIFY (stats.entries == N);
+            VERIFY (stats.tokens == N + 1);
+            VERIFY (stats.recorded_usecs == 10 * N);
+            VERIFY (stats.latency.at ("<number>").second == 2);
+            VERIFY (stats.latency.at ("prec").second == 1);
+            VERIFY (c.GetStack ().Top () == 9.0);
+            continue;
+        }
+        std::stringstream ss;
+        ss << "Checksum mismatch at entry " << bad + 1 << " '" << session[bad] << "'";
+        bool thrown = false;
+        try { Replay (c, r); }
+        catch (const runtime_error &e) { thrown = e.what () == ss.str (); }
+        VERIFY (thrown);
+    }
+    std::remove (fn);
+}
+
+void test6 ()
+{
+    Stack s;
+    Display d;
+    SuperCalc c;
+
+    const double x[] = { 2, 4, 4, 4, 5, 5, 7, 9 };
+    const size_t N = sizeof (x) / sizeof (x[0]);
+    const char *ops[] = { "count", "min", "max", "mean", "var" };
+    const double results[] = { 8.0, 2.0, 9.0, 5.0, 32.0 / 7.0 };
+    for (size_t i = 0; i < sizeof (ops) / sizeof (ops[0]); ++i)
+    {
+        for (size_t j = 0; j < N; ++j)
+            s.Push (x[j]);
+        c.Exec (ops[i], s, d);
+        VERIFY (s.Size () == 1);
+        VERIFY (AboutEqual (s.Pop (), results[i]));
+    }
+
+    // Merging partial states gives the same answer as one pass
+    Moments all, a, b, empty;
+    for (size_t j = 0; j < N; ++j)
+    {
+        all.Add (x[j]);
+        (j < 3 ? a : b).Add (x[j]);
+    }
+    a.Merge (empty);
+    a.Merge (b);
+    VERIFY (a.Count () == all.Count ());
+    VERIFY (a.Sum () == all.Sum ());
+    VERIFY (a.Min () == all.Min ());
+    VERIFY (a.Max () == all.Max ());
+    VERIFY (AboutEqual (a.Mean (), all.Mean ()));
+    VERIFY (AboutEqual (a.Var (), all.Var ()));
+    empty.Merge (all);
+    VERIFY (empty.Count () == all.Count ());
+    VERIFY (empty.Var () == all.Var ());
+
+    // The partial state survives serialization exactly
+    Moments m = Moments::Deserialize (all.Serialize ());
+    VERIFY (m.Serialize () == all.Serialize ());
+    VERIFY (m.Var () == all.Var ());
+
+    // Compensated summation
+    Moments k;
+    k.Add (1e100);
+    k.Add (1.0);
+    k.Add (-1e100);
+    VERIFY (k.Sum () == 1.0);
+
+    // Every number is counted once, whatever the shard boundaries
+    const char *fn = "test_rpn.txt";
+    {
+        std::ofstream ofs (fn);
+        for (size_t j = 0; j < 1000; ++j)
+            ofs << j << ((j % 10) ? " " : "\n  ");
+    }
+    for (size_t shards = 1; shards < 20; shards += 3)
+    {
+        Moments r = ReduceShards (fn, shards);
+        VERIFY (r.Count () == 1000);
+        VERIFY (r.Sum () == 999.0 * 1000.0 / 2.0);
+        VERIFY (r.Min () == 0.0);
+        VERIFY (r.Max () == 999.0);
+    }
+    Moments r = ReduceRange (fn, 0, 5);
+    r.Merge (ReduceRange (fn, 5, 6));
+    r.Merge (ReduceRange (fn, 6, 1 << 20));
+    VERIFY (r.Count () == 1000);
+    // Batch runs accept the same numbers as the calculator
+    {
+        std::ofstream ofs (fn);
+        ofs << "+1.5 2e1\n0x10\n";
+    }
+    bool thrown = false;
+    try { ReduceShards (fn, 2); }
+    catch (const runtime_error &e) { thrown = string (e.what ()) == "Invalid number: 0x10"; }
+    VERIFY (thrown);
+    std::remove (fn);
+
+    // A directory can't be reduced
+    thrown = false;
+    try { ReduceShards (".", 2); }
+    catch (const runtime_error &e) { thrown = string (e.what ()) == ". is not a regular file"; }
+    VERIFY (thrown);
+
+    // A pipe is reduced in one pass
+    VERIFY (mkfifo (fn, 0600) == 0);
+    const pid_t pid = fork ();
+    VERIFY (pid >= 0);
+    if (pid == 0)
+    {
+        std::ofstream ofs (fn);
+        for (size_t j = 1; j <= 10; ++j)
+            ofs << j << "\n";
+        ofs.close ();
+        _exit (0);
+    }
+    r = ReduceShards (fn, 4);
+    int status;
+    waitpid (pid, &status, 0);
+    std::remove (fn);
+    VERIFY (r.Count () == 10);
+    VERIFY (r.Sum () == 55.0);
+}
+
+// Formulas for test7
+static constexpr auto f0 = Compile ("$1 $2 + 2 /");
+static constexpr auto f1 = Compile ("$1 $2 - $1 $2 * /");
+static constexpr auto f2 = Compile ("$1 $2 pow");
+static constexpr auto f3 = Compile ("$1 sqrt $2 inv +");
+static constexpr auto f4 = Compile ("$1 sin dup * $1 cos dup * +");
+static constexpr auto f5 = Compile ("$1 lg $2 ln $2 log + +");
+static constexpr auto f6 = Compile ("$1 $2 1 2 3 sum");
+static constexpr auto f7 = Compile ("$1 $2 $1 $2 mean");
+static constexpr auto f8 = Compile ("$1 $2 0.5 var");
+static constexpr auto f9 = Compile ("$1 $2 min $1 $2 max swap clx");
+static constexpr auto f10 = Compile ("$1 rad deg chs exp");
+
+// Interpret a formula with SuperCalc
+double Interpret (const std::string &str, const std::vector<double> &args)
+{
+    Stack s;
+    Display d;
+    SuperCalc c;
+    std::stringstream ss (str);
+    std::string token;
+    while (ss >> token)
+    {
+        if (token[0] == '$')
+            s.Push (args[atoi (token.c_str () + 1) - 1]);
+        else if (c.Lookup (token))
+            c.Exec (token, s, d);
+        else
+        {
+            double x;
+            VERIFY (ParseDouble (token, x));
+            s.Push (x);
+        }
+    }
+    return s.Top ();
+}
+
+// Numbers that are long, or near the limits of a double
+static constexpr const char *numbers[] = {
+    "123456789012345678",
+    "9007199254740993",
+    "9007199254740995",
+    "0.1",
+    "3.14159265358979323846264338327950288419716939937510582097494459",
+    "1e22",
+    "1e23",
+    "-0.000000000000000000000000000000000000001234",
+    "1.7976931348623157e308",
+    "2.2250738585072011e-308",
+    "2.2250738585072014e-308",
+    "1e-320",
+    "-1e-320",
+    "4.9406564584124654e-324",
+    "2.4703282292062328e-324",
+    "100000000000000000000000000000000000000000000000000000000000000000000001e-60",
+};
+static constexpr auto n0 = Compile ("123456789012345678");
+static constexpr auto n1 = Compile ("9007199254740993");
+static constexpr auto n2 = Compile ("9007199254740995");
+static constexpr auto n3 = Compile ("0.1");
+static constexpr auto n4 = Compile ("3.14159265358979323846264338327950288419716939937510582097494459");
+static constexpr auto n5 = Compile ("1e22");
+static constexpr auto n6 = Compile ("1e23");
+static constexpr auto n7 = Compile ("-0.000000000000000000000000000000000000001234");
+static constexpr auto n8 = Compile ("1.7976931348623157e308");
+static constexpr auto n9 = Compile ("2.2250738585072011e-308");
+static constexpr auto n10 = Compile ("2.2250738585072014e-308");
+static constexpr auto n11 = Compile ("1e-320");
+static constexpr auto n12 = Compile ("-1e-320");
+static constexpr auto n13 = Compile ("4.9406564584124654e-324");
+static constexpr auto n14 = Compile ("2.4703282292062328e-324");
+static constexpr auto n15 = Compile ("100000000000000000000000000000000000000000000000000000000000000000000001e-60");
+
+// The number in a formula is the same at compile time, at run time,
+// inlined, and in the calculator
+template<const auto &F>
+bool SameNumber (const char *str)
+{
+    constexpr double c = F ();
+    const double x = Interpret (str, std::vector<double> ());
+    return c == x && F () == x && Inline<F> () == x;
+}
+
+void test7 ()
+{
+    // Compile time
+    static_assert (Evaluate ("1 2 +") == 3.0, "");
+    static_assert (Evaluate ("1 3 -") == -2.0, "");
+    static_assert (Evaluate ("4 7 /") == 4.0 / 7.0, "");
+    static_assert (Evaluate ("0.1 0.2 +") == 0.1 + 0.2, "");
+    static_assert (Evaluate ("1.5e3 -2.5E-2 *") == 1.5e3 * -2.5e-2, "");
+    static_assert (Evaluate ("1 2 3 4 5 sum") == 15.0, "");
+    static_assert (Evaluate ("2 4 4 4 5 5 7 9 var") == 32.0 / 7.0, "");
+    static_assert (Evaluate ("+") == 0.0, "");
+    static_assert (Evaluate ("1 2 swap -") == 1.0, "");
+    static_assert (Evaluate ("$1 $2 + 2 /", 1.0, 3.0) == 2.0, "");
+    static_assert (Evaluate ("$1 sto clx rcl dup *", 3) == 9.0, "");
+    constexpr auto mid = Compile ("$1 $2 + 2 /");
+    static_assert (mid (2.0, 4.0) == 3.0, "");
+
+    // The compiled, inlined and interpreted versions agree
+    const char *formulas[] = {
+        "$1 $2 + 2 /",
+        "$1 $2 - $1 $2 * /",
+        "$1 $2 pow",
+        "$1 sqrt $2 inv +",
+        "$1 sin dup * $1 cos dup * +",
+        "$1 lg $2 ln $2 log + +",
+        "$1 $2 1 2 3 sum",
+        "$1 $2 $1 $2 mean",
+        "$1 $2 0.5 var",
+        "$1 $2 min $1 $2 max swap clx",
+        "$1 rad deg chs exp",
+    };
+    for (double a = 0.25; a < 10.0; a += 0.75)
+    {
+        const double b = 11.0 - a;
+        const std::vector<double> args = { a, b };
+        VERIFY (f0 (a, b) == Interpret (formulas[0], args));
+        VERIFY (f1 (a, b) == Interpret (formulas[1], args));
+        VERIFY (f2 (a, b) == Interpret (formulas[2], args));
+        VERIFY (f3 (a, b) == Interpret (formulas[3], args));
+        VERIFY (f4 (a, b) == Interpret (formulas[4], args));
+        VERIFY (f5 (a, b) == Interpret (formulas[5], args));
+        VERIFY (f6 (a, b) == Interpret (formulas[6], args));
+        VERIFY (f7 (a, b) == Interpret (formulas[7], args));
+        VERIFY (f8 (a, b) == Interpret (formulas[8], args));
+        VERIFY (f9 (a, b) == Interpret (formulas[9], args));
+        VERIFY (f10 (a, b) == Interpret (formulas[10], args));
+        VERIFY (Inline<f0> (a, b) == f0 (a, b));
+        VERIFY (Inline<f1> (a, b) == f1 (a, b));
+        VERIFY (Inline<f2> (a, b) == f2 (a, b));
+        VERIFY (Inline<f3> (a, b) == f3 (a, b));
+        VERIFY (Inline<f4> (a, b) == f4 (a, b));
+        VERIFY (Inline<f5> (a, b) == f5 (a, b));
+        VERIFY (Inline<f6> (a, b) == f6 (a, b));
+        VERIFY (Inline<f7> (a, b) == f7 (a, b));
+        VERIFY (Inline<f8> (a, b) == f8 (a, b));
+        VERIFY (Inline<f9> (a, b) == f9 (a, b));
+        VERIFY (Inline<f10> (a, b) == f10 (a, b));
+    }
+
+    // Numbers round the same way
+    static_assert (Evaluate ("123456789012345678") == 123456789012345678.0, "");
+    static_assert (Evaluate ("1e-320") == 1e-320, "");
+    static_assert (Evaluate ("1e-320") != 0.0, "");
+    VERIFY (SameNumber<n0> (numbers[0]));
+    VERIFY (SameNumber<n1> (numbers[1]));
+    VERIFY (SameNumber<n2> (numbers[2]));
+    VERIFY (SameNumber<n3> (numbers[3]));
+    VERIFY (SameNumber<n4> (numbers[4]));
+    VERIFY (SameNumber<n5> (numbers[5]));
+    VERIFY (SameNumber<n6> (numbers[6]));
+    VERIFY (SameNumber<n7> (numbers[7]));
+    VERIFY (SameNumber<n8> (numbers[8]));
+    VERIFY (SameNumber<n9> (numbers[9]));
+    VERIFY (SameNumber<n10> (numbers[10]));
+    VERIFY (SameNumber<n11> (numbers[11]));
+    VERIFY (SameNumber<n12> (numbers[12]));
+    VERIFY (SameNumber<n13> (numbers[13]));
+    VERIFY (SameNumber<n14> (numbers[14]));
+    VERIFY (SameNumber<n15> (numbers[15]));
+    // Random digit strings and exponents
+    uint64_t y = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < 2000; ++i)
+    {
+        y ^= y << 13;
+        y ^= y >> 7;
+        y ^= y << 17;
+        std::string str = std::to_string (y % 1000000007) + std::to_string (y) + "e";
+        str += std::to_string (static_cast<int> (y % 660) - 360);
+        double x = 0.0;
+        if (!ParseDouble (str, x))
+            continue;
+        char buf[64] = { 0 };
+        str.copy (buf, sizeof (buf) - 1);
+        VERIFY (Compile (buf) () == x);
+    }
+    // Numbers the calculator rejects are rejected
+    const char bad[][32] = { "1e400", "1e-400", "1.8e308", "2.4703282292062327e-324" };
+    for (const auto &str : bad)
+    {
+        double x;
+        VERIFY (!ParseDouble (str, x));
+        bool thrown = false;
+        try { Compile (str); }
+        catch (const runtime_error &) { thrown = true; }
+        VERIFY (thrown);
+    }
+
+    // Errors
+    bool thrown = false;
+    try { Compile ("$1 abs"); }
+    catch (const runtime_error &) { thrown = true; }
+    VERIFY (thrown);
+    thrown = false;
+    try { Evaluate ("$2", 1.0); }
+    catch (const runtime_error &) { thrown = true; }
+    VERIFY (thrown);
+    thrown = false;
+    try { Evaluate ("1x"); }
+    catch (const runtime_error &) { thrown = true; }
+    VERIFY (thrown);
+}
+
+void test8 ()
+{
+    // Spill all but one chunk
+    Stack s;
+    s.SetMemoryLimit (1);
+    const size_t C = Stack::CHUNK_SIZE;
+    const size_t N = 3 * C + 10;
+    for (size_t i = 0; i < N; ++i)
+        s.Push (i);
+    VERIFY (s.Size () == N);
+    VERIFY (s.Spilled () == 3);
+    VERIFY (s.Get (0) == 0.0);
+    VERIFY (s.Get (C) == C);
+    VERIFY (s.Get (2 * C + 1) == 2 * C + 1);
+    VERIFY (s.Top () == N - 1);
+    s.Set (1, -1.0);
+    VERIFY (s.Get (1) == -1.0);
+    s.Set (1, 1.0);
+
+    // Pop down into the spilled chunks and back up
+    for (size_t i = N; i > C - 5; --i)
+        VERIFY (s.Pop () == i - 1);
+    VERIFY (s.Size () == C - 5);
+    VERIFY (s.Spilled () <= 2);
+    for (size_t i = C - 5; i < N; ++i)
+        s.Push (i);
+    double sum = 0.0;
+    size_t n = 0;
+    s.ForEach ([&] (double x) { VERIFY (x == n); sum += x; ++n; });
+    VERIFY (n == N);
+
+    // Reductions stream through the spilled chunks
+    Display d;
+    SuperCalc c;
+    c.Exec ("sum", s, d);
+    VERIFY (s.Size () == 1);
+    VERIFY (s.Top () == sum);
+    VERIFY (s.Spilled () == 0);
+    s.Clear ();
+    VERIFY (s.Empty ());
+    VERIFY (s.Pop () == 0.0);
+
+    // Raising the limit leaves spilled chunks where they are
+    for (size_t i = 0; i < N; ++i)
+        s.Push (i);
+    s.SetMemoryLimit (std::numeric_limits<size_t>::max ());
+    VERIFY (s.Spilled () == 3);
+    VERIFY (s.Get (5) == 5.0);
+
+    // Copies are deep, and spill to their own file
+    s.SetMemoryLimit (1);
+    Stack copy (s);
+    VERIFY (copy.Size () == N);
+    VERIFY (copy.Spilled () == 3);
+    copy.Set (5, -5.0);
+    VERIFY (s.Get (5) == 5.0);
+    VERIFY (copy.Get (5) == -5.0);
+    copy = s;
+    VERIFY (copy.Get (5) == 5.0);
+    VERIFY (copy.Top () == s.Top ());
+    Stack moved (std::move (copy));
+    VERIFY (moved.Size () == N);
+    VERIFY (moved.Get (C + 7) == C + 7);
+    s.Clear ();
+    VERIFY (moved.Get (2 * C) == 2 * C);
+
+    // IntStacks spill too
+    IntStack t;
+    t.SetMemoryLimit (IntStack::CHUNK_BYTES);
+    for (size_t i = 0; i < N; ++i)
+        t.Push (0x100 + i);
+    VERIFY (t.Spilled () == 3);
+    t.SetWidth (8);
+    VERIFY (t.Get (0) == 0);
+    VERIFY (t.Get (C + 3) == ((C + 3) & 0xFF));
+}
+
+void test9 ()
+{
+    Stack s;
+    VERIFY (s.Summarize ().sum.Value () == 0.0);
+    s.Push (3.0);
+    s.Push (-1.0);
+    s.Push (5.0);
+    Stack::Summary m = s.Summarize ();
+    VERIFY (m.min == -1.0);
+    VERIFY (m.max == 5.0);
+    VERIFY (m.sum.Value () == 7.0);
+    // Popping gives back the summary of what is left
+    s.Pop ();
+    m = s.Summarize ();
+    VERIFY (m.max == 3.0);
+    VERIFY (m.sum.Value () == 2.0);
+    s.Push (10.0);
+    s.Set (0, -4.0);
+    m = s.Summarize ();
+    VERIFY (m.min == -4.0);
+    VERIFY (m.max == 10.0);
+    VERIFY (m.sum.Value () == 5.0);
+    s.Clear ();
+    s.Push (2.0);
+    m = s.Summarize ();
+    VERIFY (m.min == 2.0 && m.max == 2.0 && m.sum.Value () == 2.0);
+
+    // Across chunks
+    IntStack t;
+    const size_t N = 2 * IntStack::CHUNK_SIZE + 3;
+    for (size_t i = 0; i < N; ++i)
+        t.Push (i + 1);
+    IntStack::Summary n = t.Summarize ();
+    VERIFY (n.min == 1);
+    VERIFY (n.max == N);
+    VERIFY (n.sum.Value () == N * (N + 1) / 2);
+    for (size_t i = 0; i < IntStack::CHUNK_SIZE; ++i)
+        t.Pop ();
+    n = t.Summarize ();
+    VERIFY (n.max == N - IntStack::CHUNK_SIZE);
+    // Changing a cached chunk
+    t.Set (5, 3 * N);
+    n = t.Summarize ();
+    VERIFY (n.max == 3 * N);
+    VERIFY (n.sum.Value () == (N - IntStack::CHUNK_SIZE) * (N - IntStack::CHUNK_SIZE + 1) / 2 + 3 * N - 6);
+    // Summarizing a spilled stack leaves it where it is
+    t.SetMemoryLimit (1);
+    const size_t spilled = t.Spilled ();
+    VERIFY (spilled != 0);
+    VERIFY (t.Summarize ().min == 1);
+    VERIFY (t.Spilled () == spilled);
+
+    // The sum is compensated, like the sum op
+    s.Clear ();
+    s.Push (1e16);
+    s.Push (1.0);
+    s.Push (-1e16);
+    VERIFY (s.Summarize ().sum.Value () == 1.0);
+
+    // Signed values compare as two's complement
+    IntStack u;
+    u.SetWidth (8);
+    u.Push (255);
+    u.Push (1);
+    n = u.Summarize ();
+    VERIFY (n.min == 1 && n.max == 255);
+    n = u.Summarize (true);
+    VERIFY (n.min == 255 && n.max == 1);
+    u.Push (128);
+    n = u.Summarize (true);
+    VERIFY (n.min == 128 && n.max == 1);
+    n = u.Summarize ();
+    VERIFY (n.min == 1 && n.max == 255);
+}
+
 int main ()
 {
     try
@@ -175,6 +887,12 @@ int main ()
         test1 ();
         test2 ();
         test3 ();
+        test4 ();
+        test5 ();
+        test6 ();
+        test7 ();
+        test8 ();
+        test9 ();
 
         cerr << "Success" << endl;
         return 0;
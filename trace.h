@@ -0,0 +1,233 @@
+// Session traces
+//
+// Copyright (C) 2007
+// Center for Perceptual Systems
+// University of Texas at Austin
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "librpn.h"
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace jsp
+{
+
+// A trace is a record of every token entered during a session.
+//
+// The file starts with the four byte magic "RPNT", a version byte, and
+// a byte that identifies the calculator mode.  Each entry then holds:
+//
+//      varint  token length
+//      bytes   token
+//      varint  microseconds since the previous entry
+//      4 bytes checksum of the stack after the token, little endian
+//
+// Varints are unsigned LEB128.
+const char TRACE_MAGIC[4] = { 'R', 'P', 'N', 'T' };
+const unsigned char TRACE_VERSION = 1;
+// Longer tokens can't be recorded, and a longer token length in a trace
+// file means that it is corrupt
+const size_t TRACE_MAX_TOKEN = size_t (1) << 20;
+
+struct TraceEntry
+{
+    std::string token;
+    uint64_t usecs;
+    uint32_t checksum;
+};
+
+// The checksum combines the stack depth and the bits of the top value
+inline uint32_t TraceChecksum (size_t depth, uint64_t top)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    h = (h ^ depth) * 0x100000001B3ull;
+    h = (h ^ top) * 0x100000001B3ull;
+    return static_cast<uint32_t> (h ^ (h >> 32));
+}
+
+inline uint32_t TraceChecksum (size_t depth, double top)
+{
+    uint64_t bits;
+    std::memcpy (&bits, &top, sizeof (bits));
+    return TraceChecksum (depth, bits);
+}
+
+// The checksum of a calculator's stack
+inline uint32_t TraceChecksum (const Context &context)
+{
+    if (context.Mode () == INT_MODE)
+    {
+        const IntStack &s = context.GetIntStack ();
+        return TraceChecksum (s.Size (), s.Top ());
+    }
+    const Stack &s = context.GetStack ();
+    return TraceChecksum (s.Size (), s.Top ());
+}
+
+class TraceWriter
+{
+    public:
+    TraceWriter (const std::string &fn, char mode) :
+        ofs (fn.c_str (), std::ios::binary)
+    {
+        if (!ofs)
+            throw std::runtime_error ("Could not open trace file for writing");
+        ofs.write (TRACE_MAGIC, sizeof (TRACE_MAGIC));
+        ofs.put (TRACE_VERSION);
+        ofs.put (mode);
+    }
+    void Write (const TraceEntry &e)
+    {
+        if (e.token.size () > TRACE_MAX_TOKEN)
+            throw std::runtime_error ("Token is too long for the trace file");
+        WriteVarint (e.token.size ());
+        ofs.write (e.token.data (), e.token.size ());
+        WriteVarint (e.usecs);
+        for (int i = 0; i < 32; i += 8)
+            ofs.put (static_cast<char> (e.checksum >> i));
+        if (!ofs)
+            throw std::runtime_error ("Could not write to trace file");
+    }
+    private:
+    void WriteVarint (uint64_t x)
+    {
+        while (x >= 0x80)
+        {
+            ofs.put (static_cast<char> (x | 0x80));
+            x >>= 7;
+        }
+        ofs.put (static_cast<char> (x));
+    }
+    std::ofstream ofs;
+};
+
+class TraceReader
+{
+    public:
+    TraceReader (const std::string &fn) :
+        ifs (fn.c_str (), std::ios::binary)
+    {
+        if (!ifs)
+            throw std::runtime_error ("Could not open trace file for reading");
+        char magic[sizeof (TRACE_MAGIC)];
+        ifs.read (magic, sizeof (magic));
+        if (!ifs || std::memcmp (magic, TRACE_MAGIC, sizeof (magic)) != 0)
+            throw std::runtime_error ("Not a trace file");
+        if (ifs.get () != TRACE_VERSION)
+            throw std::runtime_error ("Unsupported trace file version");
+        mode = static_cast<char> (ifs.get ());
+        if (!ifs)
+            throw std::runtime_error ("Truncated trace file");
+    }
+    char Mode () const { return mode; }
+    // Returns false at the end of the trace
+    bool Read (TraceEntry &e)
+    {
+        if (ifs.peek () == std::char_traits<char>::eof ())
+            return false;
+        const uint64_t len = ReadVarint ();
+        if (len > TRACE_MAX_TOKEN)
+            throw std::runtime_error ("Invalid trace file");
+        e.token.resize (len);
+        ifs.read (&e.token[0], len);
+        e.usecs = ReadVarint ();
+        e.checksum = 0;
+        for (int i = 0; i < 32; i += 8)
+            e.checksum |= static_cast<uint32_t> (ifs.get () & 0xFF) << i;
+        if (!ifs)
+            throw std::runtime_error ("Truncated trace file");
+        return true;
+    }
+    private:
+    uint64_t ReadVarint ()
+    {
+        uint64_t x = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            const int c = ifs.get ();
+            if (c == std::char_traits<char>::eof ())
+                throw std::runtime_error ("Truncated trace file");
+            x |= static_cast<uint64_t> (c & 0x7F) << shift;
+            if (!(c & 0x80))
+                return x;
+        }
+        throw std::runtime_error ("Invalid trace file");
+    }
+    std::ifstream ifs;
+    char mode;
+};
+
+// What a replay measured
+struct ReplayStats
+{
+    typedef std::chrono::nanoseconds ns;
+    // Trace entries.  An entry is a command and the tokens that it read,
+    // like "prec 3".
+    size_t entries;
+    size_t tokens;
+    uint64_t recorded_usecs;
+    ns total;
+    // Total time and number of entries for each command
+    std::map<std::string,std::pair<ns,size_t> > latency;
+};
+
+// Feed a trace through the calculator as fast as possible.
+//
+// Display commands are skipped.  The checksum of each entry is verified,
+// and a mismatch throws.
+inline ReplayStats Replay (Context &context, TraceReader &trace)
+{
+    typedef std::chrono::steady_clock clock;
+    typedef ReplayStats::ns ns;
+
+    context.SetDisplayEnabled (false);
+
+    ReplayStats stats;
+    stats.entries = 0;
+    stats.tokens = 0;
+    stats.recorded_usecs = 0;
+    stats.total = ns (0);
+
+    TraceEntry e;
+    while (trace.Read (e))
+    {
+        const clock::time_point start = clock::now ();
+        Result r = context.Evaluate (e.token);
+        const ns elapsed = std::chrono::duration_cast<ns> (clock::now () - start);
+
+        ++stats.entries;
+        std::istringstream iss (e.token);
+        for (std::string t; iss >> t; )
+            ++stats.tokens;
+        stats.recorded_usecs += e.usecs;
+        stats.total += elapsed;
+        const std::string command = e.token.substr (0, e.token.find (' '));
+        std::pair<ns,size_t> &l = stats.latency[context.IsNumber (command) ? "<number>" : command];
+        l.first += elapsed;
+        ++l.second;
+
+        if (TraceChecksum (context) != e.checksum)
+        {
+            std::stringstream ss;
+            ss << "Checksum mismatch at entry " << stats.entries << " '" << e.token << "'";
+            throw std::runtime_error (ss.str ());
+        }
+
+        if (r.status == EVAL_QUIT)
+            break;
+    }
+    return stats;
+}
+
+} // namespace jsp
+
+#endif // TRACE_H